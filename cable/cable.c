@@ -1,27 +1,110 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates a pair of virtual Tx / Rx serial ports: one pseudo-terminal per
+// port, whose slave side is linked from /dev/ttyS10 and /dev/ttyS11 and
+// whose master side is forwarded by the cable.
+//
+// The cable can emulate a real serial line: each direction is paced to a
+// bit rate (counting start and stop bits) and delayed by a propagation
+// delay plus a random jitter. Each direction can also be impaired by
+// seeded, reproducible noise: independent bit errors, Gilbert-Elliott
+// burst errors, byte loss and byte insertion. See usage() for the command
+// line options.
+//
+// The forwarding loop is driven by epoll. While a direction is transparent
+// (cable on, no emulation) its bytes are moved with splice() and never
+// copied to user space. Traffic is counted in memory and summarised
+// periodically, instead of logging every chunk.
+//
+// Faults can also target specific frames of the link protocol, which are
+// delimited by 0x7E flags (--fault). A rule is "ACTION:FRAME:WHEN[:MS]":
+//     ACTION  drop, corrupt (flip BCC1), dup or delay (by MS milliseconds)
+//     FRAME   I, RR, RNR, REJ, SET, UA, DISC, ECHO or any
+//     WHEN    all, next, every=N or nth=N, counting frames of that type
+// e.g. "drop:I:every=50", "corrupt:RR:next" or "delay:RR:all:200".
+// Separate several rules with ';'; "none" removes every rule.
+//
+// Both directions can be recorded to a capture file (--capture), with a
+// nanosecond timestamp and a tag for every chunk read from a port and
+// every chunk delivered to a port. "cable --decode FILE" reassembles the
+// frames of a capture, matches I frames to their RR / RNR / REJ and reports
+// service times, retransmission chains, idle gaps, the time spent in the
+// sender, the receiver and the cable, and the real line utilisation.
+//
+// A capture can be replayed (--replay) in place of one peer: the bytes the
+// other peer originally received are written to it with their original
+// timing, while the bytes it sends back are recorded and discarded. The
+// replay starts when the live peer sends its first byte if it spoke first
+// in the capture, or --replay-delay seconds after the cable is ready.
+//
+// Impairments can be scripted with a scenario file (--scenario), where each
+// line is "TIME COMMAND [VALUE] [for DURATION]", e.g.
+//     t=2s    off           for 500ms
+//     5s      ber 1e-5      for 3s
+//     8s      tx-baud 4800
+//     20s     end
+// Commands are the interactive ones (on, off, noise, end) and the line
+// options without the leading "--". Times accept the ns, us, ms and s
+// suffixes and default to seconds.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 
+#define _GNU_SOURCE // splice()
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-// Baudrate settings are defined in <asm/termbits.h>, which is
-// included by <termios.h>
-#define BAUDRATE B38400
 #define _POSIX_SOURCE 1 // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
 #define BUF_SIZE 2048
 
+// Maximum number of bytes "on the wire" in each direction. When the line
+// is full the cable stops reading from the sender, like a real UART would.
+#define LINE_QUEUE_SIZE 65536
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+// Largest chunk moved by a single splice() call.
+#define SPLICE_SIZE 65536
+
+// epoll user data of the event sources.
+#define EVENT_STDIN 0
+#define EVENT_TX 1
+#define EVENT_RX 2
+#define EVENT_LINE_TIMER 3
+#define EVENT_STATS_TIMER 4
+#define EVENT_SCENARIO_TIMER 5
+#define EVENT_REPLAY_TIMER 6
+
+#define MAX_SCENARIO_ACTIONS 1024
+
+// Frame-aware fault injection
+#define MAX_FAULT_RULES 16
+#define MAX_FRAME_SIZE 4096 // Longer "frames" are forwarded untouched
+#define FLAG 0x7E
+#define ESC 0x7D
+
+// Capture file: a CaptureHeader followed by CaptureRecords, each one
+// followed by its bytes, in host byte order.
+#define CAPTURE_MAGIC "RCOMCAP1"
+#define CAPTURE_TAG_RX2TX 0x01     // Direction Rx -> Tx, else Tx -> Rx
+#define CAPTURE_TAG_DELIVERED 0x02 // Written to the destination, else read from the source
+
 typedef enum
 {
     CableModeOn,
@@ -29,187 +112,2114 @@ typedef enum
     CableModeNoise,
 } CableMode;
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+typedef enum
+{
+    FrameI,
+    FrameRR,
+    FrameRNR,
+    FrameREJ,
+    FrameSET,
+    FrameUA,
+    FrameDISC,
+    FrameECHO,
+    FrameUnknown,
+    FrameAny,
+} FrameType;
+
+static const char *frameTypeNames[] = {"I", "RR", "RNR", "REJ", "SET", "UA", "DISC", "ECHO", "unknown", "any"};
+
+typedef enum
+{
+    FaultDrop,
+    FaultCorrupt,
+    FaultDuplicate,
+    FaultDelay,
+} FaultAction;
+
+typedef enum
+{
+    FaultAll,
+    FaultNext,
+    FaultEvery,
+    FaultNth,
+} FaultWhen;
+
+typedef struct
+{
+    FaultAction action;
+    FrameType frameType;
+    FaultWhen when;
+    unsigned long n;    // Period of FaultEvery, index of FaultNth
+    double delayMs;     // Extra delay of FaultDelay
+    unsigned long seen; // Frames of "frameType" seen since the rule was set
+    int exhausted;      // FaultNext / FaultNth already applied
+} FaultRule;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t baudRate[2]; // Tx -> Rx and Rx -> Tx, 0 if not paced
+    uint32_t bitsPerByte[2];
+} CaptureHeader;
+
+typedef struct
+{
+    uint64_t ns; // Time since the cable started
+    uint32_t size;
+    uint8_t tag;
+    uint8_t reserved[3];
+} CaptureRecord;
+
+// One direction of the cable, from the port "fdIn" to the port "fdOut".
+typedef struct
+{
+    int index; // 0 for Tx -> Rx, 1 for Rx -> Tx
+    const char *from;
+    const char *to;
+    int fdIn;
+    int fdOut;
+
+    // Line emulation settings
+    long baudRate;   // Bits per second, 0 disables pacing
+    int bitsPerByte; // Start + data + parity + stop bits
+    double delayMs;  // Propagation delay
+    double jitterMs; // Maximum extra delay, uniformly distributed
+
+    // Noise models, as probabilities
+    double ber;        // Independent bit errors
+    double geGoodBad;  // Gilbert-Elliott: Good -> Bad, per bit
+    double geBadGood;  // Gilbert-Elliott: Bad -> Good, per bit
+    double geGoodBer;  // Gilbert-Elliott: bit error rate in Good state
+    double geBadBer;   // Gilbert-Elliott: bit error rate in Bad state
+    double lossRate;   // Byte loss, per byte
+    double insertRate; // Random byte insertion, per byte
+    int geBad;         // Gilbert-Elliott current state
+    uint64_t randomState;
+
+    // Frame-aware faults and the frame being reassembled
+    FaultRule faults[MAX_FAULT_RULES];
+    int nFaults;
+    char faultSpec[256];
+    unsigned char frame[MAX_FRAME_SIZE];
+    size_t frameSize; // 0 when outside a frame
+    unsigned long faultsInjected;
+
+    // Noise statistics
+    unsigned long bitErrors;
+    unsigned long bytesLost;
+    unsigned long bytesInserted;
+
+    // Traffic statistics
+    unsigned long long bytesIn;      // Read from "fdIn"
+    unsigned long long bytesOut;     // Written to "fdOut"
+    unsigned long long bytesDropped; // Discarded while the cable is off
+    unsigned long long lastBytesOut; // "bytesOut" at the previous summary
+
+    // splice() path, used while the direction is transparent
+    int pipe[2];
+    int spliceEnabled;
+    int reading; // "fdIn" is in the epoll interest list
+
+    // Bytes in flight and the time at which each one reaches "fdOut"
+    unsigned char queue[LINE_QUEUE_SIZE];
+    uint64_t deliverAt[LINE_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    uint64_t lineFreeAt;    // Time at which the last queued bit is sent
+    uint64_t lastDeliverAt; // Jitter never reorders bytes
+} Direction;
+
+// Timed command of a scenario file.
+typedef struct
+{
+    uint64_t at;       // Time since the cable started, in nanoseconds
+    uint64_t duration; // Revert the command after this time, 0 keeps it
+    int done;
+    char command[32];
+    char value[64];
+} ScenarioAction;
+
+static Direction tx2rx = {.index = 0, .from = "Tx", .to = "Rx", .bitsPerByte = 10, .faultSpec = "none"};
+static Direction rx2tx = {.index = 1, .from = "Rx", .to = "Tx", .bitsPerByte = 10, .faultSpec = "none"};
+
+static const char *txPort = "/dev/ttyS10";
+static const char *rxPort = "/dev/ttyS11";
+
+static CableMode cableMode = CableModeOn;
+static volatile sig_atomic_t STOP = FALSE;
+
+static const char *captureName = NULL;
+static const char *decodeName = NULL;
+static FILE *captureFile = NULL;
+static uint64_t cableStart;
+
+// Chunk of a capture to be replayed.
+typedef struct
+{
+    uint64_t ns; // Time of the chunk in the capture
+    size_t offset; // Position of its bytes in "replayData"
+    uint32_t size;
+} ReplayChunk;
+
+static const char *replayName = NULL;
+static int replaySide = -1; // Index of the direction whose sender is replaced
+static double replayDelay = 1.0;
+static ReplayChunk *replayChunks = NULL;
+static unsigned char *replayData = NULL;
+static size_t replayCount = 0;
+static size_t replayNext = 0;
+static uint64_t replayFirstLive = UINT64_MAX; // First byte sent by the live peer in the capture
+static int replayStarted = FALSE;
+static uint64_t replayOffset; // Added to capture times to get monotonic times
+static uint64_t replayMaxLate = 0;
+
+static const char *scenarioFile = NULL;
+static ScenarioAction scenario[MAX_SCENARIO_ACTIONS];
+static int scenarioSize = 0;
+static double statsInterval = 1.0; // Seconds between summaries, 0 disables them
+
+// Returns: current monotonic time, in nanoseconds.
+uint64_t nowNs()
 {
-    int fd = open(serialPort, O_RDWR | O_NOCTTY);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// Seed the random number generators. Each direction gets its own stream,
+// so the noise in one direction does not depend on the traffic in the other.
+void seedRandom(uint64_t seed)
+{
+    // splitmix64, never yields a zero state for xorshift
+    Direction *dirs[] = {&tx2rx, &rx2tx};
+    for (int d = 0; d < 2; d++)
+    {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        dirs[d]->randomState = (z ^ (z >> 31)) | 1;
+    }
+}
+
+// Returns: uniformly distributed random number in [0, 1).
+double nextRandom(Direction *dir)
+{
+    // xorshift64*
+    dir->randomState ^= dir->randomState >> 12;
+    dir->randomState ^= dir->randomState << 25;
+    dir->randomState ^= dir->randomState >> 27;
+    return ((dir->randomState * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Create a pseudo-terminal and link its slave side from "serialPort".
+// The slave stays open in "slaveFd", so the master does not hang up while
+// the application has the port closed.
+// Returns: master file descriptor (fd), or -1 on error.
+int openVirtualPort(const char *serialPort, int *slaveFd)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
 
     if (fd < 0)
         return -1;
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
+    const char *slaveName = NULL;
+    if (grantpt(fd) == 0 && unlockpt(fd) == 0)
+        slaveName = ptsname(fd);
+
+    if (slaveName == NULL || chmod(slaveName, 0666) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    *slaveFd = open(slaveName, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (*slaveFd < 0)
+    {
+        close(fd);
         return -1;
+    }
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 1; // Inter-character timer unused
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+    // Until the application configures the port, do not echo or translate
+    struct termios tio;
+    if (tcgetattr(*slaveFd, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(*slaveFd, TCSANOW, &tio);
+    }
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
+    unlink(serialPort);
+    if (symlink(slaveName, serialPort) != 0)
+    {
+        close(*slaveFd);
+        close(fd);
         return -1;
+    }
 
     return fd;
 }
 
+// Terminate the main loop on SIGINT / SIGTERM, so the ports are removed.
+void stopHandler(int signal)
+{
+    (void)signal;
+    STOP = TRUE;
+}
+
 // Add noise to a buffer, by flipping the byte in the "errorIndex" position.
 void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 {
     buf[errorIndex] ^= 0xFF;
 }
 
-int main(int argc, char *argv[])
+// Flip the bits of "buf" hit by the independent and burst error models.
+void addBitErrors(Direction *dir, unsigned char *buf, size_t size)
 {
-    printf("\n");
+    int burst = dir->geGoodBad > 0;
 
-    system("socat -dd PTY,link=/dev/ttyS10,mode=777 PTY,link=/dev/ttyS11,mode=777 &");
-    sleep(1);
-    printf("\n");
+    if (dir->ber <= 0 && !burst)
+        return;
 
-    system("socat -dd PTY,link=/dev/ttyS11,mode=777 PTY,link=/dev/ttyS10,mode=777 &");
-    sleep(1);
+    for (size_t i = 0; i < size; i++)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            double errorRate = dir->ber;
 
-    printf("\n\n"
-           "Transmitter must open /dev/ttyS10\n"
-           "Receiver must open /dev/ttyS11\n"
-           "\n"
-           "The cable program is sensible to the following interactive commands:\n"
-           "--- on           : connect the cable and data is exchanged (default state)\n"
-           "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- noise        : add fixed noise to the cable\n"
-           "--- end          : terminate the program\n"
-           "\n");
+            if (burst)
+            {
+                if (nextRandom(dir) < (dir->geBad ? dir->geBadGood : dir->geGoodBad))
+                    dir->geBad = !dir->geBad;
+                errorRate += dir->geBad ? dir->geBadBer : dir->geGoodBer;
+            }
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+            if (errorRate > 0 && nextRandom(dir) < errorRate)
+            {
+                buf[i] ^= 1 << bit;
+                dir->bitErrors++;
+            }
+        }
+    }
+}
 
-    int fdTx = openSerialPort("/dev/ttyS10", &oldtioTx, &newtioTx);
+// Apply byte loss and insertion to "in", writing the result to "out", which
+// must hold 2 * "size" bytes.
+// Returns: number of bytes in "out".
+size_t addByteErrors(Direction *dir, const unsigned char *in, size_t size, unsigned char *out)
+{
+    size_t outSize = 0;
 
-    if (fdTx < 0)
+    for (size_t i = 0; i < size; i++)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        if (dir->lossRate > 0 && nextRandom(dir) < dir->lossRate)
+            dir->bytesLost++;
+        else
+            out[outSize++] = in[i];
+
+        if (dir->insertRate > 0 && nextRandom(dir) < dir->insertRate)
+        {
+            out[outSize++] = (unsigned char)(nextRandom(dir) * 256);
+            dir->bytesInserted++;
+        }
     }
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+    return outSize;
+}
 
-    int fdRx = openSerialPort("/dev/ttyS11", &oldtioRx, &newtioRx);
+// Put "size" bytes read at "now" on the line. Each byte is delivered once
+// its stop bit has been sent, plus the propagation delay, the jitter and
+// "extraNs". Bytes that do not fit in the line are dropped.
+void enqueueOnLine(Direction *dir, const unsigned char *buf, size_t size, uint64_t now, uint64_t extraNs)
+{
+    uint64_t start = dir->lineFreeAt > now ? dir->lineFreeAt : now;
+    double byteNs = dir->baudRate > 0 ? (double)dir->bitsPerByte * NS_PER_SEC / dir->baudRate : 0;
+    uint64_t extra = (uint64_t)((dir->delayMs + dir->jitterMs * nextRandom(dir)) * NS_PER_MS) + extraNs;
 
-    if (fdRx < 0)
+    if (size > LINE_QUEUE_SIZE - dir->count)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        dir->bytesDropped += size - (LINE_QUEUE_SIZE - dir->count);
+        size = LINE_QUEUE_SIZE - dir->count;
     }
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    for (size_t i = 0; i < size; i++)
+    {
+        uint64_t sent = start + (uint64_t)(byteNs * (i + 1));
+        uint64_t deliver = sent + extra;
 
-    unsigned char tx2rx[BUF_SIZE] = {0};
-    unsigned char rx2tx[BUF_SIZE] = {0};
-    char rxStdin[BUF_SIZE] = {0};
+        if (deliver < dir->lastDeliverAt)
+            deliver = dir->lastDeliverAt;
 
-    CableMode cableMode = CableModeOn;
-    volatile int STOP = FALSE;
+        size_t pos = (dir->head + dir->count) % LINE_QUEUE_SIZE;
+        dir->queue[pos] = buf[i];
+        dir->deliverAt[pos] = deliver;
+        dir->count++;
+        dir->lastDeliverAt = deliver;
+    }
 
-    printf("Cable ready\n");
+    dir->lineFreeAt = start + (uint64_t)(byteNs * size);
+}
 
-    while (STOP == FALSE)
+// Record "size" bytes of "dir" in the capture file, if there is one.
+void captureBytes(const Direction *dir, int delivered, const unsigned char *buf, size_t size)
+{
+    if (captureFile == NULL || size == 0)
+        return;
+
+    CaptureRecord record = {.ns = nowNs() - cableStart, .size = size};
+    record.tag = (dir->index == 1 ? CAPTURE_TAG_RX2TX : 0) | (delivered ? CAPTURE_TAG_DELIVERED : 0);
+
+    fwrite(&record, sizeof(record), 1, captureFile);
+    fwrite(buf, 1, size, captureFile);
+}
+
+// Write every byte whose delivery time has passed to the destination port.
+void deliverFromLine(Direction *dir, uint64_t now)
+{
+    while (dir->count > 0 && dir->deliverAt[dir->head] <= now)
+    {
+        // Bytes are delivered in order, so the due ones are contiguous
+        size_t due = 0;
+        size_t contiguous = LINE_QUEUE_SIZE - dir->head;
+        while (due < dir->count && due < contiguous && dir->deliverAt[dir->head + due] <= now)
+            due++;
+
+        int written = write(dir->fdOut, dir->queue + dir->head, due);
+        if (written <= 0)
+            return;
+
+        captureBytes(dir, TRUE, dir->queue + dir->head, written);
+        dir->bytesOut += written;
+        dir->head = (dir->head + written) % LINE_QUEUE_SIZE;
+        dir->count -= written;
+    }
+}
+
+// Apply the noise models to "size" bytes and put them on the line.
+void sendToLine(Direction *dir, unsigned char *buf, size_t size, uint64_t extraNs)
+{
+    unsigned char impaired[2 * MAX_FRAME_SIZE];
+
+    while (size > 0)
+    {
+        size_t chunk = size < MAX_FRAME_SIZE ? size : MAX_FRAME_SIZE;
+
+        addBitErrors(dir, buf, chunk);
+        size_t bytesToLine = addByteErrors(dir, buf, chunk, impaired);
+        enqueueOnLine(dir, impaired, bytesToLine, nowNs(), extraNs);
+
+        buf += chunk;
+        size -= chunk;
+    }
+}
+
+// Returns: type of the frame "frame" (flag, address, control, ...).
+FrameType frameType(const unsigned char *frame, size_t size)
+{
+    if (size < 5)
+        return FrameUnknown;
+
+    // I frames of a packet split across several frames also carry 0x20
+    if ((frame[2] & ~0x60) == 0)
+        return FrameI;
+
+    switch (frame[2])
+    {
+    case 0x05:
+    case 0x85:
+        return FrameRR;
+    case 0x09:
+    case 0x89:
+        return FrameRNR;
+    case 0x01:
+    case 0x81:
+        return FrameREJ;
+    case 0x03:
+        return FrameSET;
+    case 0x07:
+        return FrameUA;
+    case 0x0B:
+        return FrameDISC;
+    case 0x0D:
+    case 0x0F:
+        return FrameECHO;
+    default:
+        return FrameUnknown;
+    }
+}
+
+// Apply the fault rules of "dir" to a complete frame and put it on the line.
+void forwardFrame(Direction *dir, unsigned char *frame, size_t size)
+{
+    FrameType type = frameType(frame, size);
+    int copies = 1;
+    uint64_t extraNs = 0;
+
+    for (int i = 0; i < dir->nFaults; i++)
+    {
+        FaultRule *rule = &dir->faults[i];
+
+        if (rule->exhausted || (rule->frameType != FrameAny && rule->frameType != type))
+            continue;
+
+        rule->seen++;
+
+        int apply = rule->when == FaultAll ||
+                    (rule->when == FaultNext) ||
+                    (rule->when == FaultEvery && rule->seen % rule->n == 0) ||
+                    (rule->when == FaultNth && rule->seen == rule->n);
+        if (!apply)
+            continue;
+
+        if (rule->when == FaultNext || rule->when == FaultNth)
+            rule->exhausted = TRUE;
+
+        switch (rule->action)
+        {
+        case FaultDrop:
+            copies = 0;
+            break;
+        case FaultCorrupt:
+            // No control byte in use has a BCC1 of 0xFE or 0xFD, so the flip
+            // never turns it into a flag or an escape
+            frame[3] ^= 0x80;
+            break;
+        case FaultDuplicate:
+            if (copies > 0)
+                copies = 2;
+            break;
+        case FaultDelay:
+            extraNs += (uint64_t)(rule->delayMs * NS_PER_MS);
+            break;
+        }
+
+        static const char *actionNames[] = {"dropped", "corrupted", "duplicated", "delayed"};
+        printf("%s -> %s: %s %s frame #%lu\n", dir->from, dir->to,
+               actionNames[rule->action], frameTypeNames[type], rule->seen);
+        dir->faultsInjected++;
+    }
+
+    for (int c = 0; c < copies; c++)
+    {
+        unsigned char copy[MAX_FRAME_SIZE];
+        memcpy(copy, frame, size);
+        sendToLine(dir, copy, size, extraNs);
+    }
+}
+
+// Split the bytes read from the port into frames for the fault rules.
+// Bytes outside frames are forwarded as they are.
+void parseFrames(Direction *dir, const unsigned char *buf, size_t size)
+{
+    unsigned char outside[BUF_SIZE];
+    size_t nOutside = 0;
+
+    for (size_t i = 0; i < size; i++)
     {
-        // Read from Tx
-        int bytesFromTx = read(fdTx, tx2rx, BUF_SIZE);
+        unsigned char byte = buf[i];
 
-        if (bytesFromTx > 0)
+        if (dir->frameSize == 0)
         {
-            if (cableMode == CableModeOff)
+            if (byte == FLAG)
             {
-                printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFromTx);
+                sendToLine(dir, outside, nOutside, 0);
+                nOutside = 0;
+                dir->frame[dir->frameSize++] = byte;
             }
             else
             {
-                if (cableMode == CableModeNoise)
-                {
-                    addNoiseToBuffer(tx2rx, 0);
-                }
-
-                int bytesToRx = write(fdRx, tx2rx, bytesFromTx);
-                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
+                outside[nOutside++] = byte;
             }
+            continue;
+        }
+
+        if (byte == FLAG && dir->frameSize == 1)
+        {
+            // Two flags in a row: the first one was not an opening flag.
+            // The line adds noise to what it sends, so the flag held as
+            // the opening one must go out from a copy
+            unsigned char flag = FLAG;
+            sendToLine(dir, &flag, 1, 0);
+            continue;
         }
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, rx2tx, BUF_SIZE);
+        dir->frame[dir->frameSize++] = byte;
 
-        if (bytesFromRx > 0)
+        if (byte == FLAG)
         {
-            if (cableMode == CableModeOff)
-            {
-                printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFromRx);
-            }
-            else
-            {
-                if (cableMode == CableModeNoise)
-                {
-                    addNoiseToBuffer(rx2tx, 0);
-                }
+            forwardFrame(dir, dir->frame, dir->frameSize);
+            dir->frameSize = 0;
+        }
+        else if (dir->frameSize == MAX_FRAME_SIZE)
+        {
+            // No longer held once sent: the noise may land on it in place
+            sendToLine(dir, dir->frame, dir->frameSize, 0);
+            dir->frameSize = 0;
+        }
+    }
 
-                int bytesToTx = write(fdTx, rx2tx, bytesFromRx);
-                printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
-            }
+    sendToLine(dir, outside, nOutside, 0);
+}
+
+// Parse the fault rules "spec" (see the top of this file) into "dir".
+// Returns: 0 on success, -1 on error.
+int setFaultRules(Direction *dir, const char *spec)
+{
+    FaultRule rules[MAX_FAULT_RULES];
+    int nRules = 0;
+    char copy[sizeof(dir->faultSpec)];
+
+    if (strlen(spec) >= sizeof(copy))
+        return -1;
+    strcpy(copy, spec);
+
+    char *savedRule;
+    for (char *text = strtok_r(copy, ";", &savedRule); text != NULL && strcmp(spec, "none") != 0;
+         text = strtok_r(NULL, ";", &savedRule))
+    {
+        if (nRules == MAX_FAULT_RULES)
+            return -1;
+
+        FaultRule *rule = &rules[nRules++];
+        memset(rule, 0, sizeof(*rule));
+
+        char *savedField;
+        char *action = strtok_r(text, ":", &savedField);
+        char *type = strtok_r(NULL, ":", &savedField);
+        char *when = strtok_r(NULL, ":", &savedField);
+        char *delay = strtok_r(NULL, ":", &savedField);
+
+        if (action == NULL || type == NULL || when == NULL)
+            return -1;
+
+        if (strcmp(action, "drop") == 0)
+            rule->action = FaultDrop;
+        else if (strcmp(action, "corrupt") == 0)
+            rule->action = FaultCorrupt;
+        else if (strcmp(action, "dup") == 0)
+            rule->action = FaultDuplicate;
+        else if (strcmp(action, "delay") == 0 && delay != NULL)
+            rule->action = FaultDelay;
+        else
+            return -1;
+
+        if (delay != NULL)
+        {
+            rule->delayMs = atof(delay);
+            if (rule->action != FaultDelay || rule->delayMs < 0)
+                return -1;
         }
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+        rule->frameType = FrameUnknown;
+        for (int t = FrameI; t <= FrameAny; t++)
         {
-            rxStdin[fromStdin - 1] = '\0';
+            if (t != FrameUnknown && strcasecmp(type, frameTypeNames[t]) == 0)
+                rule->frameType = t;
+        }
+        if (rule->frameType == FrameUnknown)
+            return -1;
 
-            if (strcmp(rxStdin, "off") == 0 || strcmp(rxStdin, "0") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                cableMode = CableModeOff;
-            }
-            else if (strcmp(rxStdin, "on") == 0 || strcmp(rxStdin, "1") == 0)
-            {
-                printf("CONNECTION ON\n");
-                cableMode = CableModeOn;
-            }
-            else if (strcmp(rxStdin, "noise") == 0 || strcmp(rxStdin, "2") == 0)
-            {
-                printf("CONNECTION NOISE\n");
-                cableMode = CableModeNoise;
-            }
-            else if (strcmp(rxStdin, "end") == 0)
+        if (strcmp(when, "all") == 0)
+            rule->when = FaultAll;
+        else if (strcmp(when, "next") == 0)
+            rule->when = FaultNext;
+        else if (strncmp(when, "every=", 6) == 0 && (rule->n = strtoul(when + 6, NULL, 10)) > 0)
+            rule->when = FaultEvery;
+        else if (strncmp(when, "nth=", 4) == 0 && (rule->n = strtoul(when + 4, NULL, 10)) > 0)
+            rule->when = FaultNth;
+        else
+            return -1;
+    }
+
+    memcpy(dir->faults, rules, sizeof(rules));
+    dir->nFaults = nRules;
+    strcpy(dir->faultSpec, nRules > 0 ? spec : "none");
+    return 0;
+}
+
+// Returns: TRUE if the bytes of "dir" can be forwarded untouched.
+int isTransparent(const Direction *dir)
+{
+    return cableMode == CableModeOn && dir->count == 0 && dir->baudRate == 0 &&
+           dir->delayMs == 0 && dir->jitterMs == 0 && dir->ber == 0 &&
+           dir->geGoodBad == 0 && dir->lossRate == 0 && dir->insertRate == 0 &&
+           dir->nFaults == 0 && dir->frameSize == 0 && captureFile == NULL;
+}
+
+// Move the bytes available on "fdIn" to "fdOut" through the kernel pipe.
+// Returns: 0 on success, -1 if splice() is not supported by the ports.
+int spliceFromPort(Direction *dir)
+{
+    ssize_t bytesIn = splice(dir->fdIn, NULL, dir->pipe[1], NULL, SPLICE_SIZE,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (bytesIn < 0)
+        return errno == EAGAIN ? 0 : -1;
+
+    dir->bytesIn += bytesIn;
+
+    while (bytesIn > 0)
+    {
+        ssize_t bytesOut = splice(dir->pipe[0], NULL, dir->fdOut, NULL, bytesIn, SPLICE_F_MOVE);
+
+        if (bytesOut <= 0)
+        {
+            // Never leave stale bytes in the pipe
+            unsigned char buf[BUF_SIZE];
+            while (bytesIn > 0)
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
+                int chunk = read(dir->pipe[0], buf, bytesIn < BUF_SIZE ? bytesIn : BUF_SIZE);
+                if (chunk <= 0)
+                    break;
+                dir->bytesOut += write(dir->fdOut, buf, chunk);
+                bytesIn -= chunk;
             }
+            return -1;
         }
+
+        dir->bytesOut += bytesOut;
+        bytesIn -= bytesOut;
     }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    return 0;
+}
+
+// Start the replay so that capture time "ns" is monotonic time "now".
+void startReplay(uint64_t ns, uint64_t now)
+{
+    replayOffset = now - ns;
+    replayStarted = TRUE;
+    printf("Replay started\n");
+}
+
+// Read from a port while replaying. The bytes of the live peer are kept in
+// the capture but go nowhere, like the bytes sent to the replaced peer's port.
+void readFromPortReplaying(Direction *dir)
+{
+    unsigned char buf[BUF_SIZE];
+    int bytesRead = read(dir->fdIn, buf, BUF_SIZE);
+
+    if (bytesRead <= 0)
+        return;
+
+    dir->bytesIn += bytesRead;
+    dir->bytesDropped += bytesRead;
+    captureBytes(dir, FALSE, buf, bytesRead);
+
+    if (dir->index != replaySide && !replayStarted && replayFirstLive != UINT64_MAX)
+        startReplay(replayFirstLive, nowNs());
+}
+
+// Write the replayed chunks that are due to the live peer.
+void replayDue(uint64_t now)
+{
+    Direction *dir = replaySide == 0 ? &tx2rx : &rx2tx;
+
+    while (replayStarted && replayNext < replayCount &&
+           replayChunks[replayNext].ns + replayOffset <= now)
     {
-        perror("tcsetattr");
-        exit(-1);
+        const ReplayChunk *chunk = &replayChunks[replayNext++];
+        uint64_t late = now - (chunk->ns + replayOffset);
+        if (late > replayMaxLate)
+            replayMaxLate = late;
+
+        int written = write(dir->fdOut, replayData + chunk->offset, chunk->size);
+        if (written > 0)
+        {
+            captureBytes(dir, TRUE, replayData + chunk->offset, written);
+            dir->bytesOut += written;
+        }
     }
 
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    if (replayStarted && replayNext == replayCount)
     {
-        perror("tcsetattr");
-        exit(-1);
+        printf("Replay finished: %zu chunks, at most %.3f ms late\n", replayCount,
+               (double)replayMaxLate / NS_PER_MS);
+        replayStarted = FALSE;
+        replayCount = 0;
     }
+}
 
-    close(fdTx);
-    close(fdRx);
+// Arm "timerFd" to expire at the next replayed chunk, or disarm it.
+void armReplayTimer(int timerFd)
+{
+    uint64_t due = replayStarted && replayNext < replayCount
+                       ? replayChunks[replayNext].ns + replayOffset
+                       : 0;
+    if (replayStarted && due == 0)
+        due = 1;
+
+    struct itimerspec spec = {.it_value = {.tv_sec = due / NS_PER_SEC,
+                                           .tv_nsec = due % NS_PER_SEC}};
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Load the chunks delivered by the replaced peer from the capture "filename".
+// Returns: 0 on success, -1 on error.
+int loadReplay(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    CaptureHeader header;
+
+    if (file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a cable capture\n", filename);
+        fclose(file);
+        return -1;
+    }
+
+    size_t capacity = 0;
+    size_t dataSize = 0;
+    CaptureRecord record;
+
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        int dir = record.tag & CAPTURE_TAG_RX2TX ? 1 : 0;
+        int delivered = record.tag & CAPTURE_TAG_DELIVERED ? 1 : 0;
+
+        if (dir != replaySide && !delivered && record.ns < replayFirstLive)
+            replayFirstLive = record.ns;
+
+        if (dir != replaySide || !delivered)
+        {
+            fseek(file, record.size, SEEK_CUR);
+            continue;
+        }
+
+        if (replayCount == capacity)
+        {
+            capacity = capacity > 0 ? 2 * capacity : 1024;
+            replayChunks = realloc(replayChunks, capacity * sizeof(ReplayChunk));
+        }
+        replayData = realloc(replayData, dataSize + record.size);
+
+        if (replayChunks == NULL || replayData == NULL ||
+            fread(replayData + dataSize, 1, record.size, file) != record.size)
+        {
+            fprintf(stderr, "%s: truncated capture\n", filename);
+            fclose(file);
+            return -1;
+        }
+
+        replayChunks[replayCount].ns = record.ns;
+        replayChunks[replayCount].offset = dataSize;
+        replayChunks[replayCount].size = record.size;
+        replayCount++;
+        dataSize += record.size;
+    }
+
+    fclose(file);
+
+    // If the live peer did not speak first, do not wait for it
+    if (replayCount > 0 && replayFirstLive > replayChunks[0].ns)
+        replayFirstLive = UINT64_MAX;
+
+    printf("Replaying %zu chunks (%zu bytes) to the %s\n", replayCount, dataSize,
+           replaySide == 0 ? "receiver" : "transmitter");
+    return 0;
+}
+
+// Read from the source port of "dir" and put the bytes on the line.
+void readFromPort(Direction *dir)
+{
+    if (replaySide >= 0)
+    {
+        readFromPortReplaying(dir);
+        return;
+    }
+
+    if (dir->spliceEnabled && isTransparent(dir))
+    {
+        if (spliceFromPort(dir) == 0)
+            return;
+
+        // Fall back to read() / write() for ports without splice support
+        dir->spliceEnabled = FALSE;
+    }
+
+    unsigned char buf[BUF_SIZE];
+    size_t space = LINE_QUEUE_SIZE - dir->count;
+
+    // Leave room for a held frame, duplicated frames and inserted bytes
+    if (dir->nFaults > 0)
+        space = space > 2 * MAX_FRAME_SIZE ? (space - 2 * MAX_FRAME_SIZE) / 2 : 0;
+    if (dir->insertRate > 0)
+        space /= 2;
+    if (space == 0)
+        return;
+
+    int bytesRead = read(dir->fdIn, buf, space < BUF_SIZE ? space : BUF_SIZE);
+
+    if (bytesRead <= 0)
+        return;
+
+    dir->bytesIn += bytesRead;
+    captureBytes(dir, FALSE, buf, bytesRead);
+
+    if (cableMode == CableModeOff)
+    {
+        dir->bytesDropped += bytesRead;
+        return;
+    }
+
+    if (cableMode == CableModeNoise)
+    {
+        addNoiseToBuffer(buf, 0);
+    }
+
+    if (dir->nFaults > 0 || dir->frameSize > 0)
+        parseFrames(dir, buf, bytesRead);
+    else
+        sendToLine(dir, buf, bytesRead, 0);
+}
+
+void usage(const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  --baud BPS     pace each direction to BPS bits/s (default: no pacing)\n"
+           "  --bits N       bits per byte on the line, 8N1 is 10 (default: 10)\n"
+           "  --delay MS     propagation delay in milliseconds (default: 0)\n"
+           "  --jitter MS    extra random delay in [0, MS] milliseconds (default: 0)\n"
+           "  --ber P        independent bit error probability (default: 0)\n"
+           "  --ge P,R[,EG,EB]\n"
+           "                 Gilbert-Elliott burst errors: per bit probability of going\n"
+           "                 Good -> Bad (P) and Bad -> Good (R), bit error rate in the\n"
+           "                 Good (EG, default: 0) and Bad (EB, default: 0.5) states\n"
+           "  --loss P       byte loss probability (default: 0)\n"
+           "  --insert P     random byte insertion probability (default: 0)\n"
+           "  --fault RULES  frame-aware faults, e.g. \"drop:I:every=50;corrupt:RR:next\",\n"
+           "                 see the top of cable.c (default: none)\n"
+           "  --seed N       seed of the noise and jitter generators (default: 0)\n"
+           "  --tx-port PATH link of the transmitter port (default: /dev/ttyS10)\n"
+           "  --rx-port PATH link of the receiver port (default: /dev/ttyS11)\n"
+           "  --scenario FILE\n"
+           "                 run the timed commands of FILE, see the top of cable.c\n"
+           "  --capture FILE record the traffic of both directions to FILE\n"
+           "  --decode FILE  analyse the capture FILE and exit\n"
+           "  --replay FILE  replay the capture FILE in place of one peer\n"
+           "  --replay-side tx|rx\n"
+           "                 peer replaced by the capture (required with --replay)\n"
+           "  --replay-delay SEC\n"
+           "                 start of the replay if the live peer does not speak\n"
+           "                 first in the capture (default: 1)\n"
+           "  --stats SEC    seconds between traffic summaries, 0 disables them\n"
+           "                 (default: 1)\n"
+           "Line options apply to both directions. Prefix them with \"tx-\" (Tx to Rx)\n"
+           "or \"rx-\" (Rx to Tx) to set a single direction, e.g. --rx-delay 20.\n",
+           program);
+}
+
+// Returns: TRUE if "p" is a valid probability.
+int isProbability(double p)
+{
+    return p >= 0 && p <= 1;
+}
+
+// Set the line option "name" of "dir" to "value".
+// Returns: 0 on success, -1 on unknown option or invalid value.
+int setLineOption(Direction *dir, const char *name, const char *value)
+{
+    if (strcmp(name, "baud") == 0)
+    {
+        dir->baudRate = atol(value);
+        return dir->baudRate >= 0 ? 0 : -1;
+    }
+    else if (strcmp(name, "bits") == 0)
+    {
+        dir->bitsPerByte = atoi(value);
+        return dir->bitsPerByte > 0 ? 0 : -1;
+    }
+    else if (strcmp(name, "delay") == 0)
+    {
+        dir->delayMs = atof(value);
+        return dir->delayMs >= 0 ? 0 : -1;
+    }
+    else if (strcmp(name, "jitter") == 0)
+    {
+        dir->jitterMs = atof(value);
+        return dir->jitterMs >= 0 ? 0 : -1;
+    }
+    else if (strcmp(name, "ber") == 0)
+    {
+        dir->ber = atof(value);
+        return isProbability(dir->ber) ? 0 : -1;
+    }
+    else if (strcmp(name, "ge") == 0)
+    {
+        dir->geGoodBer = 0;
+        dir->geBadBer = 0.5;
+        dir->geBad = FALSE;
+        if (sscanf(value, "%lf,%lf,%lf,%lf", &dir->geGoodBad, &dir->geBadGood,
+                   &dir->geGoodBer, &dir->geBadBer) < 2)
+            return -1;
+        return isProbability(dir->geGoodBad) && isProbability(dir->geBadGood) &&
+                       isProbability(dir->geGoodBer) && isProbability(dir->geBadBer)
+                   ? 0
+                   : -1;
+    }
+    else if (strcmp(name, "loss") == 0)
+    {
+        dir->lossRate = atof(value);
+        return isProbability(dir->lossRate) ? 0 : -1;
+    }
+    else if (strcmp(name, "insert") == 0)
+    {
+        dir->insertRate = atof(value);
+        return isProbability(dir->insertRate) ? 0 : -1;
+    }
+    else if (strcmp(name, "fault") == 0)
+    {
+        return setFaultRules(dir, value);
+    }
+
+    return -1;
+}
+
+// Write the current value of the line option "name" of "dir" to "value".
+// Returns: 0 on success, -1 on unknown option.
+int getLineOption(const Direction *dir, const char *name, char *value, size_t size)
+{
+    if (strcmp(name, "baud") == 0)
+        snprintf(value, size, "%ld", dir->baudRate);
+    else if (strcmp(name, "bits") == 0)
+        snprintf(value, size, "%d", dir->bitsPerByte);
+    else if (strcmp(name, "delay") == 0)
+        snprintf(value, size, "%.17g", dir->delayMs);
+    else if (strcmp(name, "jitter") == 0)
+        snprintf(value, size, "%.17g", dir->jitterMs);
+    else if (strcmp(name, "ber") == 0)
+        snprintf(value, size, "%.17g", dir->ber);
+    else if (strcmp(name, "ge") == 0)
+        snprintf(value, size, "%.17g,%.17g,%.17g,%.17g", dir->geGoodBad,
+                 dir->geBadGood, dir->geGoodBer, dir->geBadBer);
+    else if (strcmp(name, "loss") == 0)
+        snprintf(value, size, "%.17g", dir->lossRate);
+    else if (strcmp(name, "insert") == 0)
+        snprintf(value, size, "%.17g", dir->insertRate);
+    else if (strcmp(name, "fault") == 0)
+        snprintf(value, size, "%s", dir->faultSpec);
+    else
+        return -1;
+
+    return 0;
+}
+
+// Set the line option "option", which applies to both directions unless it
+// is prefixed with "tx-" or "rx-".
+// Returns: 0 on success, -1 on unknown option or invalid value.
+int applyLineOption(const char *option, const char *value)
+{
+    int setTx = TRUE;
+    int setRx = TRUE;
+
+    if (strncmp(option, "tx-", 3) == 0)
+    {
+        setRx = FALSE;
+        option += 3;
+    }
+    else if (strncmp(option, "rx-", 3) == 0)
+    {
+        setTx = FALSE;
+        option += 3;
+    }
+
+    if ((setTx && setLineOption(&tx2rx, option, value) != 0) ||
+        (setRx && setLineOption(&rx2tx, option, value) != 0))
+        return -1;
+
+    return 0;
+}
+
+const char *cableModeName(CableMode mode)
+{
+    return mode == CableModeOff ? "off" : mode == CableModeNoise ? "noise" : "on";
+}
+
+// Run an interactive or scenario command. "value" is NULL for the cable
+// modes and "end".
+// Returns: 0 on success, -1 on unknown command or invalid value.
+int runCommand(const char *command, const char *value)
+{
+    if (value == NULL)
+    {
+        if (strcmp(command, "off") == 0 || strcmp(command, "0") == 0)
+        {
+            printf("CONNECTION OFF\n");
+            cableMode = CableModeOff;
+        }
+        else if (strcmp(command, "on") == 0 || strcmp(command, "1") == 0)
+        {
+            printf("CONNECTION ON\n");
+            cableMode = CableModeOn;
+        }
+        else if (strcmp(command, "noise") == 0 || strcmp(command, "2") == 0)
+        {
+            printf("CONNECTION NOISE\n");
+            cableMode = CableModeNoise;
+        }
+        else if (strcmp(command, "end") == 0)
+        {
+            printf("END OF THE PROGRAM\n");
+            STOP = TRUE;
+        }
+        else
+            return -1;
+
+        return 0;
+    }
+
+    if (applyLineOption(command, value) != 0)
+        return -1;
+
+    printf("%s %s\n", command, value);
+    return 0;
+}
+
+// Parse a time such as "2s", "500ms" or "t=1.5" (seconds).
+// Returns: 0 on success, -1 on error.
+int parseTime(const char *text, uint64_t *ns)
+{
+    if (strncmp(text, "t=", 2) == 0)
+        text += 2;
+
+    char *unit;
+    double value = strtod(text, &unit);
+    double scale;
+
+    if (unit == text || value < 0)
+        return -1;
+
+    if (*unit == '\0' || strcmp(unit, "s") == 0)
+        scale = NS_PER_SEC;
+    else if (strcmp(unit, "ms") == 0)
+        scale = NS_PER_MS;
+    else if (strcmp(unit, "us") == 0)
+        scale = 1000;
+    else if (strcmp(unit, "ns") == 0)
+        scale = 1;
+    else
+        return -1;
+
+    *ns = (uint64_t)(value * scale);
+    return 0;
+}
+
+// Add a scenario action, running "command" at "at".
+// Returns: 0 on success, -1 if the scenario is full.
+int addScenarioAction(uint64_t at, uint64_t duration, const char *command, const char *value)
+{
+    if (scenarioSize == MAX_SCENARIO_ACTIONS)
+        return -1;
+
+    ScenarioAction *action = &scenario[scenarioSize++];
+    action->at = at;
+    action->duration = duration;
+    action->done = FALSE;
+    snprintf(action->command, sizeof(action->command), "%s", command);
+    snprintf(action->value, sizeof(action->value), "%s", value != NULL ? value : "");
+    return 0;
+}
+
+// Load the scenario file "filename".
+// Returns: 0 on success, -1 on error.
+int loadScenario(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+
+    if (file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    char line[256];
+    int lineNumber = 0;
+    int reverts = 0; // Actions runScenario will add to restore old values
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        char *tokens[5];
+        int nTokens = 0;
+        for (char *token = strtok(line, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n"))
+        {
+            if (nTokens == 5)
+                break;
+            tokens[nTokens++] = token;
+        }
+
+        if (nTokens == 0)
+            continue;
+
+        // TIME COMMAND [VALUE] [for DURATION]
+        uint64_t at;
+        uint64_t duration = 0;
+        const char *value = NULL;
+        int next = 2;
+
+        int valid = nTokens >= 2 && parseTime(tokens[0], &at) == 0;
+        if (valid && next < nTokens && strcmp(tokens[next], "for") != 0)
+            value = tokens[next++];
+        if (valid && next < nTokens)
+        {
+            valid = strcmp(tokens[next], "for") == 0 && next + 2 == nTokens &&
+                    parseTime(tokens[next + 1], &duration) == 0;
+            next += 2;
+        }
+        valid = valid && next >= nTokens;
+
+        // Validate the command on a scratch copy of the settings, static
+        // since a Direction holds its whole queue
+        if (valid && value != NULL)
+        {
+            static Direction scratch;
+            scratch = tx2rx;
+            const char *option = tokens[1];
+            if (strncmp(option, "tx-", 3) == 0 || strncmp(option, "rx-", 3) == 0)
+                option += 3;
+            valid = setLineOption(&scratch, option, value) == 0;
+        }
+        else if (valid)
+        {
+            valid = strcmp(tokens[1], "on") == 0 || strcmp(tokens[1], "off") == 0 ||
+                    strcmp(tokens[1], "noise") == 0 || strcmp(tokens[1], "end") == 0;
+        }
+
+        if (!valid)
+        {
+            fprintf(stderr, "%s:%d: invalid scenario action\n", filename, lineNumber);
+            fclose(file);
+            return -1;
+        }
+
+        // An option without a tx- / rx- prefix is restored in both directions
+        if (duration > 0)
+        {
+            int prefixed = strncmp(tokens[1], "tx-", 3) == 0 || strncmp(tokens[1], "rx-", 3) == 0;
+            reverts += value != NULL && !prefixed ? 2 : 1;
+        }
+
+        if (scenarioSize + 1 + reverts > MAX_SCENARIO_ACTIONS ||
+            addScenarioAction(at, duration, tokens[1], value) != 0)
+        {
+            fprintf(stderr, "%s:%d: scenario too long, at most %d actions counting the reverts\n",
+                    filename, lineNumber, MAX_SCENARIO_ACTIONS);
+            fclose(file);
+            return -1;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Run the scenario actions due "elapsed" nanoseconds after the cable started.
+// Actions with a duration schedule the command that restores the old value.
+void runScenario(uint64_t elapsed)
+{
+    for (int i = 0; i < scenarioSize; i++)
+    {
+        // Actions may be added by the loop, so do not keep pointers
+        if (scenario[i].done || scenario[i].at > elapsed)
+            continue;
+
+        scenario[i].done = TRUE;
+        ScenarioAction action = scenario[i];
+        const char *value = action.value[0] != '\0' ? action.value : NULL;
+        uint64_t revertAt = action.at + action.duration;
+
+        printf("t=%.3fs ", (double)elapsed / NS_PER_SEC);
+
+        if (action.duration > 0 && value == NULL)
+        {
+            addScenarioAction(revertAt, 0, cableModeName(cableMode), NULL);
+        }
+        else if (action.duration > 0)
+        {
+            const char *option = action.command;
+            int prefixed = strncmp(option, "tx-", 3) == 0 || strncmp(option, "rx-", 3) == 0;
+            char name[3 + sizeof(action.command)]; // A prefix and the option
+            char old[64];
+
+            for (int d = 0; d < 2; d++)
+            {
+                const char *prefix = d == 0 ? "tx-" : "rx-";
+                if (prefixed && strncmp(option, prefix, 3) != 0)
+                    continue;
+
+                snprintf(name, sizeof(name), "%s%.*s", prefix, (int)sizeof(action.command) - 1,
+                         prefixed ? option + 3 : option);
+                getLineOption(d == 0 ? &tx2rx : &rx2tx, name + 3, old, sizeof(old));
+                addScenarioAction(revertAt, 0, name, old);
+            }
+        }
+
+        runCommand(action.command, value);
+    }
+}
+
+// Arm "timerFd" to expire at the next scenario action, or disarm it.
+void armScenarioTimer(int timerFd, uint64_t start)
+{
+    uint64_t next = 0;
+    int pending = FALSE;
+
+    for (int i = 0; i < scenarioSize; i++)
+    {
+        if (!scenario[i].done && (!pending || scenario[i].at < next))
+        {
+            next = scenario[i].at;
+            pending = TRUE;
+        }
+    }
+
+    uint64_t due = pending ? start + next : 0;
+    struct itimerspec spec = {.it_value = {.tv_sec = due / NS_PER_SEC,
+                                           .tv_nsec = due % NS_PER_SEC}};
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Parse the command line options.
+// Returns: 0 on success, -1 on error.
+int parseOptions(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *option = argv[i];
+
+        if (strncmp(option, "--", 2) != 0 || i + 1 >= argc)
+            return -1;
+        option += 2;
+
+        const char *value = argv[++i];
+
+        if (strcmp(option, "tx-port") == 0)
+        {
+            txPort = value;
+            continue;
+        }
+        else if (strcmp(option, "rx-port") == 0)
+        {
+            rxPort = value;
+            continue;
+        }
+        else if (strcmp(option, "seed") == 0)
+        {
+            seedRandom(strtoull(value, NULL, 0));
+            continue;
+        }
+        else if (strcmp(option, "stats") == 0)
+        {
+            statsInterval = atof(value);
+            if (statsInterval < 0)
+                return -1;
+            continue;
+        }
+        else if (strcmp(option, "capture") == 0)
+        {
+            captureName = value;
+            continue;
+        }
+        else if (strcmp(option, "decode") == 0)
+        {
+            decodeName = value;
+            continue;
+        }
+        else if (strcmp(option, "replay") == 0)
+        {
+            replayName = value;
+            continue;
+        }
+        else if (strcmp(option, "replay-side") == 0)
+        {
+            if (strcmp(value, "tx") == 0)
+                replaySide = 0;
+            else if (strcmp(value, "rx") == 0)
+                replaySide = 1;
+            else
+                return -1;
+            continue;
+        }
+        else if (strcmp(option, "replay-delay") == 0)
+        {
+            replayDelay = atof(value);
+            if (replayDelay < 0)
+                return -1;
+            continue;
+        }
+        else if (strcmp(option, "scenario") == 0)
+        {
+            scenarioFile = value;
+            continue;
+        }
+
+        if (applyLineOption(option, value) != 0)
+            return -1;
+    }
+
+    if ((replayName == NULL) != (replaySide < 0))
+        return -1;
+
+    // The scenario is validated against the final settings
+    if (scenarioFile != NULL && loadScenario(scenarioFile) != 0)
+        return -1;
+
+    return 0;
+}
+
+void printLineSettings(const Direction *dir)
+{
+    if (dir->baudRate > 0)
+        printf("%s -> %s: %ld bit/s (%d bits per byte), ", dir->from, dir->to,
+               dir->baudRate, dir->bitsPerByte);
+    else
+        printf("%s -> %s: no pacing, ", dir->from, dir->to);
+
+    printf("delay %.3f ms, jitter %.3f ms\n", dir->delayMs, dir->jitterMs);
+
+    if (dir->nFaults > 0)
+        printf("%s -> %s: faults %s\n", dir->from, dir->to, dir->faultSpec);
+
+    if (dir->ber > 0 || dir->geGoodBad > 0 || dir->lossRate > 0 || dir->insertRate > 0)
+        printf("%s -> %s: BER %g, Gilbert-Elliott %g/%g (BER %g/%g), loss %g, insertion %g\n",
+               dir->from, dir->to, dir->ber, dir->geGoodBad, dir->geBadGood,
+               dir->geGoodBer, dir->geBadBer, dir->lossRate, dir->insertRate);
+}
+
+// Print the traffic of "dir" since the previous summary, "elapsed" seconds ago.
+void printTrafficSummary(Direction *dir, double elapsed)
+{
+    double rate = (dir->bytesOut - dir->lastBytesOut) / elapsed;
+
+    printf("%s -> %s: %.0f B/s (%.0f bit/s), %llu bytes in, %llu bytes out, %llu dropped, %zu on the line\n",
+           dir->from, dir->to, rate, rate * dir->bitsPerByte, dir->bytesIn,
+           dir->bytesOut, dir->bytesDropped, dir->count);
+
+    dir->lastBytesOut = dir->bytesOut;
+}
+
+// Add, modify or remove (events = 0) the epoll interest of "fd".
+void watchFd(int epollFd, int fd, uint32_t events, uint64_t id)
+{
+    struct epoll_event event = {.events = events, .data.u64 = id};
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) != 0)
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Arm "timerFd" to expire at the first pending delivery, or disarm it.
+void armLineTimer(int timerFd)
+{
+    uint64_t due = 0;
+    const Direction *dirs[] = {&tx2rx, &rx2tx};
+
+    for (int d = 0; d < 2; d++)
+    {
+        uint64_t next = dirs[d]->deliverAt[dirs[d]->head];
+        if (dirs[d]->count > 0 && (due == 0 || next < due))
+            due = next;
+    }
+
+    // An absolute time of zero would disarm the timer
+    if (due == 0 && (tx2rx.count > 0 || rx2tx.count > 0))
+        due = 1;
+
+    struct itimerspec spec = {.it_value = {.tv_sec = due / NS_PER_SEC,
+                                           .tv_nsec = due % NS_PER_SEC}};
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Stop reading from a direction whose line is full, resume when it drains.
+void updateReadInterest(int epollFd, Direction *dir, uint64_t id)
+{
+    int reading = dir->count < LINE_QUEUE_SIZE;
+
+    if (reading != dir->reading)
+    {
+        watchFd(epollFd, dir->fdIn, reading ? EPOLLIN : 0, id);
+        dir->reading = reading;
+    }
+}
+
+void printNoiseStatistics(const Direction *dir)
+{
+    printf("%s -> %s: %lu bit errors, %lu bytes lost, %lu bytes inserted, %lu frame faults\n",
+           dir->from, dir->to, dir->bitErrors, dir->bytesLost, dir->bytesInserted,
+           dir->faultsInjected);
+}
+
+////////////////////////////////////////////////
+// CAPTURE DECODER
+////////////////////////////////////////////////
+
+// Frame reassembled from a capture.
+typedef struct
+{
+    uint64_t start; // Time of the opening flag
+    uint64_t end;   // Time of the closing flag
+    int dir;        // 0 for Tx -> Rx, 1 for Rx -> Tx
+    int delivered;  // Written to the destination, else read from the source
+    FrameType type;
+    int seq;           // N(s) of I frames, N(r) of RR / RNR / REJ
+    int valid;         // BCC1 and BCC2 are correct
+    size_t wireSize;   // Bytes on the line, flags included
+    uint64_t dataHash; // FNV-1a of the destuffed data, tells retransmissions apart
+} CapturedFrame;
+
+// Byte stream being reassembled: one per direction and capture point.
+typedef struct
+{
+    unsigned char frame[MAX_FRAME_SIZE];
+    size_t size;
+    uint64_t start;
+} FrameStream;
+
+typedef struct
+{
+    CapturedFrame *frames;
+    size_t count;
+    size_t capacity;
+} FrameList;
+
+// Statistics of one kind of delay.
+typedef struct
+{
+    unsigned long count;
+    double total;
+    double max;
+} DelayStats;
+
+void addDelay(DelayStats *stats, uint64_t ns)
+{
+    double ms = (double)ns / NS_PER_MS;
+    stats->count++;
+    stats->total += ms;
+    if (ms > stats->max)
+        stats->max = ms;
+}
+
+void printDelay(const char *name, const DelayStats *stats)
+{
+    printf("  %-22s %8lu  avg %10.3f ms  max %10.3f ms  total %10.3f s\n", name, stats->count,
+           stats->count > 0 ? stats->total / stats->count : 0, stats->max, stats->total / 1000);
+}
+
+// Decode the complete frame of "stream" and append it to "list".
+void decodeFrame(FrameList *list, const FrameStream *stream, uint64_t end, int dir, int delivered)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity > 0 ? 2 * list->capacity : 1024;
+        list->frames = realloc(list->frames, list->capacity * sizeof(CapturedFrame));
+        if (list->frames == NULL)
+        {
+            perror("realloc");
+            exit(-1);
+        }
+    }
+
+    const unsigned char *frame = stream->frame;
+    CapturedFrame *captured = &list->frames[list->count++];
+    memset(captured, 0, sizeof(*captured));
+    captured->start = stream->start;
+    captured->end = end;
+    captured->dir = dir;
+    captured->delivered = delivered;
+    captured->type = frameType(frame, stream->size);
+    captured->wireSize = stream->size;
+    captured->seq = (frame[2] & 0xC0) ? 1 : 0;
+    captured->valid = stream->size >= 5 && frame[3] == (frame[1] ^ frame[2]);
+
+    if (captured->type != FrameI && captured->type != FrameECHO)
+    {
+        captured->valid = captured->valid && stream->size == 5;
+        return;
+    }
+
+    // Destuff the data and BCC2
+    unsigned char bcc2 = 0;
+    unsigned char last = 0;
+    size_t dataSize = 0;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 4; i + 1 < stream->size; i++)
+    {
+        unsigned char byte = frame[i];
+        if (byte == ESC && i + 2 < stream->size)
+            byte = frame[++i] ^ 0x20;
+
+        if (dataSize > 0)
+        {
+            bcc2 ^= last;
+            hash = (hash ^ last) * 0x100000001B3ULL;
+        }
+        last = byte;
+        dataSize++;
+    }
+
+    captured->valid = captured->valid && dataSize > 0 && bcc2 == last;
+    captured->dataHash = hash;
+}
+
+// Read the capture "filename" into "list", with the line settings in "header".
+// Also accumulates the idle gaps of the delivered bytes of each direction.
+int readCapture(const char *filename, CaptureHeader *header, FrameList *list,
+                DelayStats idle[2], unsigned long long bytes[2], uint64_t *duration)
+{
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    if (fread(header, sizeof(*header), 1, file) != 1 ||
+        memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a cable capture\n", filename);
+        fclose(file);
+        return -1;
+    }
+
+    FrameStream streams[4];
+    memset(streams, 0, sizeof(streams));
+    uint64_t lastDelivery[2] = {0, 0};
+    CaptureRecord record;
+    unsigned char buf[LINE_QUEUE_SIZE];
+
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (record.size > sizeof(buf) || fread(buf, 1, record.size, file) != record.size)
+        {
+            fprintf(stderr, "%s: truncated capture\n", filename);
+            break;
+        }
+
+        int dir = record.tag & CAPTURE_TAG_RX2TX ? 1 : 0;
+        int delivered = record.tag & CAPTURE_TAG_DELIVERED ? 1 : 0;
+        FrameStream *stream = &streams[2 * dir + delivered];
+
+        if (delivered)
+        {
+            // A gap longer than two characters, or 1 ms if not paced, is idle time
+            uint64_t threshold = header->baudRate[dir] > 0
+                                     ? 2ULL * header->bitsPerByte[dir] * NS_PER_SEC / header->baudRate[dir]
+                                     : NS_PER_MS;
+            if (lastDelivery[dir] > 0 && record.ns - lastDelivery[dir] > threshold)
+                addDelay(&idle[dir], record.ns - lastDelivery[dir]);
+            lastDelivery[dir] = record.ns;
+            bytes[dir] += record.size;
+        }
+        *duration = record.ns;
+
+        for (uint32_t i = 0; i < record.size; i++)
+        {
+            unsigned char byte = buf[i];
+
+            if (stream->size == 0 || (byte == FLAG && stream->size == 1))
+            {
+                if (byte == FLAG)
+                {
+                    stream->frame[0] = byte;
+                    stream->size = 1;
+                    stream->start = record.ns;
+                }
+                continue;
+            }
+
+            stream->frame[stream->size++] = byte;
+
+            if (byte == FLAG)
+            {
+                decodeFrame(list, stream, record.ns, dir, delivered);
+                stream->size = 0;
+            }
+            else if (stream->size == MAX_FRAME_SIZE)
+            {
+                stream->size = 0;
+            }
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Sort frames by the time they were complete.
+int compareFrames(const void *a, const void *b)
+{
+    const CapturedFrame *fa = a;
+    const CapturedFrame *fb = b;
+    return fa->end < fb->end ? -1 : fa->end > fb->end ? 1 : fa->delivered - fb->delivered;
+}
+
+// I frame waiting for its acknowledgement.
+typedef struct
+{
+    int active;
+    int seq;
+    uint64_t dataHash;
+    uint64_t firstStart;   // The sender wrote the first attempt
+    uint64_t lastAttempt;  // The sender wrote the last attempt
+    int rejectedSince;     // A REJ or RNR reached the sender after the last attempt
+    int attempts;
+    int rejects;
+    int refusals;
+    int timeouts;
+    unsigned long index;
+} InFlight;
+
+// Analyse the capture "filename" and print the report.
+// Returns: 0 on success, -1 on error.
+int decodeCapture(const char *filename)
+{
+    CaptureHeader header;
+    FrameList list = {0};
+    DelayStats idle[2] = {{0}};
+    unsigned long long bytes[2] = {0, 0};
+    uint64_t duration = 0;
+
+    if (readCapture(filename, &header, &list, idle, bytes, &duration) != 0)
+        return -1;
+
+    qsort(list.frames, list.count, sizeof(CapturedFrame), compareFrames);
+
+    const char *dirNames[] = {"Tx -> Rx", "Rx -> Tx"};
+    unsigned long frameCounts[2][FrameAny] = {{0}};
+    unsigned long invalid[2] = {0, 0};
+    DelayStats service = {0};
+    DelayStats senderTurnaround = {0};
+    DelayStats receiverTurnaround = {0};
+    DelayStats transit = {0};
+    DelayStats timeoutWait = {0};
+    unsigned long chains = 0;
+    unsigned long retransmissions = 0;
+    unsigned long staleAcks = 0;
+    unsigned long refusals = 0;
+
+    InFlight inFlight[2] = {{0}};
+    uint64_t lastIngressEnd[2] = {0, 0};     // Last frame read from the sender of each direction
+    uint64_t pendingForReceiver[2] = {0, 0}; // I frame delivered, response not written yet
+    uint64_t pendingForSender[2] = {0, 0};   // Response delivered, next frame not written yet
+    unsigned long iFrames = 0;
+
+    printf("Frames (times in ms since the cable started):\n");
+
+    for (size_t i = 0; i < list.count; i++)
+    {
+        CapturedFrame *frame = &list.frames[i];
+        int dir = frame->dir;
+        int other = 1 - dir;
+
+        if (!frame->delivered)
+        {
+            // Written by a peer: its turnaround starts when the previous
+            // frame of the other direction was delivered to it
+            if (pendingForSender[dir] > 0 && frame->start >= pendingForSender[dir])
+                addDelay(&senderTurnaround, frame->start - pendingForSender[dir]);
+            if (pendingForReceiver[other] > 0 && frame->start >= pendingForReceiver[other])
+                addDelay(&receiverTurnaround, frame->start - pendingForReceiver[other]);
+            pendingForSender[dir] = 0;
+            pendingForReceiver[other] = 0;
+            lastIngressEnd[dir] = frame->end;
+
+            if (frame->type != FrameI)
+                continue;
+
+            InFlight *flight = &inFlight[dir];
+            if (flight->active && flight->seq == frame->seq && flight->dataHash == frame->dataHash)
+            {
+                // Retransmission: after a REJ or RNR, or else after a timeout
+                flight->attempts++;
+                if (!flight->rejectedSince)
+                {
+                    flight->timeouts++;
+                    addDelay(&timeoutWait, frame->start - flight->lastAttempt);
+                }
+                flight->rejectedSince = FALSE;
+                flight->lastAttempt = frame->start;
+                continue;
+            }
+
+            if (flight->active)
+                printf("  #%-6lu %s I(%d) superseded by a new frame before any acknowledgement, %d attempts\n", flight->index,
+                       dirNames[dir], flight->seq, flight->attempts);
+
+            memset(flight, 0, sizeof(*flight));
+            flight->active = TRUE;
+            flight->seq = frame->seq;
+            flight->dataHash = frame->dataHash;
+            flight->firstStart = frame->start;
+            flight->lastAttempt = frame->start;
+            flight->attempts = 1;
+            flight->index = ++iFrames;
+            continue;
+        }
+
+        // Delivered to a peer
+        frameCounts[dir][frame->type]++;
+        if (!frame->valid)
+        {
+            invalid[dir]++;
+            continue;
+        }
+
+        if (lastIngressEnd[dir] > 0 && frame->end >= lastIngressEnd[dir])
+            addDelay(&transit, frame->end - lastIngressEnd[dir]);
+
+        // Calibration probes and their echoes are not part of the transfer
+        if (frame->type == FrameECHO)
+            continue;
+
+        if (frame->type == FrameI)
+        {
+            pendingForReceiver[dir] = frame->end;
+            continue;
+        }
+
+        pendingForSender[dir] = frame->end;
+        if ((frame->type != FrameRR && frame->type != FrameRNR && frame->type != FrameREJ) ||
+            !inFlight[other].active)
+            continue;
+
+        // RR(N) and RNR(N) acknowledge I(1 - N); RR(N) for I(N) is a stale
+        // duplicate, RNR(N) for I(N) means the receiver had no room for it
+        InFlight *flight = &inFlight[other];
+        if (frame->type == FrameRR && frame->seq == flight->seq)
+        {
+            staleAcks++;
+            continue;
+        }
+
+        if (frame->type == FrameRNR && frame->seq == flight->seq)
+        {
+            refusals++;
+            flight->refusals++;
+            flight->rejectedSince = TRUE;
+            continue;
+        }
+
+        if (frame->type == FrameREJ)
+        {
+            flight->rejects++;
+            flight->rejectedSince = TRUE;
+            continue;
+        }
+
+        uint64_t serviceNs = frame->end - flight->firstStart;
+        addDelay(&service, serviceNs);
+        printf("  #%-6lu %s I(%d) t=%12.3f  service %10.3f ms  attempts %d", flight->index,
+               dirNames[other], flight->seq, (double)flight->firstStart / NS_PER_MS,
+               (double)serviceNs / NS_PER_MS, flight->attempts);
+        if (flight->attempts > 1)
+        {
+            printf("  (%d after REJ, %d after RNR, %d after timeout)", flight->rejects,
+                   flight->refusals, flight->timeouts);
+            chains++;
+            retransmissions += flight->attempts - 1;
+        }
+        printf("\n");
+        flight->active = FALSE;
+    }
+
+    printf("\nCapture: %.3f s, %zu frames\n", (double)duration / NS_PER_SEC, list.count);
+
+    for (int d = 0; d < 2; d++)
+    {
+        printf("%s:", dirNames[d]);
+        for (int t = FrameI; t < FrameAny; t++)
+        {
+            if (frameCounts[d][t] > 0)
+                printf(" %lu %s", frameCounts[d][t], frameTypeNames[t]);
+        }
+        printf(", %lu with bad BCC, %llu bytes", invalid[d], bytes[d]);
+
+        double seconds = (double)duration / NS_PER_SEC;
+        if (header.baudRate[d] > 0 && seconds > 0)
+            printf(", line utilisation %.1f %%",
+                   100.0 * bytes[d] * header.bitsPerByte[d] / header.baudRate[d] / seconds);
+        else if (seconds > 0)
+            printf(", %.0f B/s", bytes[d] / seconds);
+        printf(", idle %.3f s in %lu gaps (max %.3f ms)\n", idle[d].total / 1000, idle[d].count,
+               idle[d].max);
+    }
+
+    printf("\nI frames: %lu, %lu acknowledged, %lu retransmission chains, %lu retransmissions, "
+           "%lu stale RR, %lu refused with RNR\n",
+           iFrames, service.count, chains, retransmissions, staleAcks, refusals);
+    printf("Where the time went:\n");
+    printDelay("service time", &service);
+    printDelay("sender turnaround", &senderTurnaround);
+    printDelay("receiver turnaround", &receiverTurnaround);
+    printDelay("cable transit", &transit);
+    printDelay("waiting for timeouts", &timeoutWait);
+
+    free(list.frames);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    seedRandom(0);
+
+    if (parseOptions(argc, argv) != 0)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (decodeName != NULL)
+        return decodeCapture(decodeName) == 0 ? 0 : 1;
+
+    if (replayName != NULL && loadReplay(replayName) != 0)
+        exit(1);
+
+    if (captureName != NULL)
+    {
+        captureFile = fopen(captureName, "wb");
+        if (captureFile == NULL)
+        {
+            perror(captureName);
+            exit(-1);
+        }
+
+        CaptureHeader header = {.magic = CAPTURE_MAGIC};
+        Direction *dirs[] = {&tx2rx, &rx2tx};
+        for (int d = 0; d < 2; d++)
+        {
+            header.baudRate[d] = dirs[d]->baudRate;
+            header.bitsPerByte[d] = dirs[d]->bitsPerByte;
+        }
+        fwrite(&header, sizeof(header), 1, captureFile);
+    }
+
+    // Create the serial ports
+    int slaveTx;
+    int fdTx = openVirtualPort(txPort, &slaveTx);
+
+    if (fdTx < 0)
+    {
+        perror("Creating Tx emulator serial port");
+        exit(-1);
+    }
+
+    int slaveRx;
+    int fdRx = openVirtualPort(rxPort, &slaveRx);
+
+    if (fdRx < 0)
+    {
+        perror("Creating Rx emulator serial port");
+        unlink(txPort);
+        exit(-1);
+    }
+
+    printf("\n"
+           "Transmitter must open %s\n"
+           "Receiver must open %s\n"
+           "\n"
+           "The cable program is sensible to the following interactive commands:\n"
+           "--- on           : connect the cable and data is exchanged (default state)\n"
+           "--- off          : disconnect the cable disabling data to be exchanged\n"
+           "--- noise        : add fixed noise to the cable\n"
+           "--- end          : terminate the program\n"
+           "--- OPTION VALUE : set a line option, e.g. \"tx-ber 1e-5\" or \"baud 4800\"\n"
+           "\n",
+           txPort, rxPort);
+
+    printLineSettings(&tx2rx);
+    printLineSettings(&rx2tx);
+    printf("\n");
+
+    struct sigaction action = {.sa_handler = stopHandler};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    tx2rx.fdIn = fdTx;
+    tx2rx.fdOut = fdRx;
+    rx2tx.fdIn = fdRx;
+    rx2tx.fdOut = fdTx;
+
+    // Configure stdin to receive commands to this program
+    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+
+    // Configure the event loop
+    int epollFd = epoll_create1(0);
+    int lineTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    int statsTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    int scenarioTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    int replayTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+
+    if (epollFd < 0 || lineTimerFd < 0 || statsTimerFd < 0 || scenarioTimerFd < 0 ||
+        replayTimerFd < 0)
+    {
+        perror("Creating the event loop");
+        exit(-1);
+    }
+
+    Direction *dirs[] = {&tx2rx, &rx2tx};
+    for (int d = 0; d < 2; d++)
+    {
+        if (pipe(dirs[d]->pipe) != 0)
+            dirs[d]->pipe[0] = dirs[d]->pipe[1] = -1;
+        dirs[d]->spliceEnabled = dirs[d]->pipe[0] >= 0;
+        dirs[d]->reading = TRUE;
+    }
+
+    watchFd(epollFd, STDIN_FILENO, EPOLLIN, EVENT_STDIN);
+    watchFd(epollFd, fdTx, EPOLLIN, EVENT_TX);
+    watchFd(epollFd, fdRx, EPOLLIN, EVENT_RX);
+    watchFd(epollFd, lineTimerFd, EPOLLIN, EVENT_LINE_TIMER);
+    watchFd(epollFd, statsTimerFd, EPOLLIN, EVENT_STATS_TIMER);
+    watchFd(epollFd, scenarioTimerFd, EPOLLIN, EVENT_SCENARIO_TIMER);
+    watchFd(epollFd, replayTimerFd, EPOLLIN, EVENT_REPLAY_TIMER);
+
+    if (statsInterval > 0)
+    {
+        uint64_t interval = (uint64_t)(statsInterval * NS_PER_SEC);
+        struct timespec period = {.tv_sec = interval / NS_PER_SEC,
+                                  .tv_nsec = interval % NS_PER_SEC};
+        struct itimerspec spec = {.it_interval = period, .it_value = period};
+        timerfd_settime(statsTimerFd, 0, &spec, NULL);
+    }
+
+    char rxStdin[BUF_SIZE] = {0};
+    uint64_t start = nowNs();
+    cableStart = start;
+    uint64_t lastSummary = start;
+
+    printf("Cable ready\n");
+
+    runScenario(0);
+    armScenarioTimer(scenarioTimerFd, start);
+
+    if (replayCount > 0 && replayFirstLive == UINT64_MAX)
+        startReplay(replayChunks[0].ns, start + (uint64_t)(replayDelay * NS_PER_SEC));
+
+    while (STOP == FALSE)
+    {
+        struct epoll_event events[8];
+        int nEvents = epoll_wait(epollFd, events, 8, -1);
+
+        for (int e = 0; e < nEvents; e++)
+        {
+            uint64_t expirations;
+
+            switch (events[e].data.u64)
+            {
+            case EVENT_TX:
+                readFromPort(&tx2rx);
+                break;
+            case EVENT_RX:
+                readFromPort(&rx2tx);
+                break;
+            case EVENT_LINE_TIMER:
+                read(lineTimerFd, &expirations, sizeof(expirations));
+                break;
+            case EVENT_REPLAY_TIMER:
+                read(replayTimerFd, &expirations, sizeof(expirations));
+                break;
+            case EVENT_SCENARIO_TIMER:
+                read(scenarioTimerFd, &expirations, sizeof(expirations));
+                runScenario(nowNs() - start);
+                armScenarioTimer(scenarioTimerFd, start);
+                break;
+            case EVENT_STATS_TIMER:
+                read(statsTimerFd, &expirations, sizeof(expirations));
+                uint64_t now = nowNs();
+                if (tx2rx.bytesOut != tx2rx.lastBytesOut || rx2tx.bytesOut != rx2tx.lastBytesOut ||
+                    tx2rx.count > 0 || rx2tx.count > 0)
+                {
+                    double elapsed = (double)(now - lastSummary) / NS_PER_SEC;
+                    printTrafficSummary(&tx2rx, elapsed);
+                    printTrafficSummary(&rx2tx, elapsed);
+                }
+                lastSummary = now;
+                break;
+            case EVENT_STDIN:
+            {
+                // Read commands from STDIN to control the cable mode
+                int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
+                if (fromStdin == 0)
+                {
+                    // No more commands, e.g. stdin is /dev/null
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                }
+                else if (fromStdin > 0)
+                {
+                    rxStdin[fromStdin < BUF_SIZE ? fromStdin : BUF_SIZE - 1] = '\0';
+
+                    // One command per line
+                    char *savedLine;
+                    for (char *line = strtok_r(rxStdin, "\n", &savedLine); line != NULL;
+                         line = strtok_r(NULL, "\n", &savedLine))
+                    {
+                        char *command = strtok(line, " \t\r");
+                        char *value = strtok(NULL, " \t\r");
+                        if (command != NULL && runCommand(command, value) != 0)
+                            printf("Unknown command\n");
+                    }
+                }
+                break;
+            }
+            }
+        }
+
+        // Deliver the bytes that reached the end of the line
+        uint64_t now = nowNs();
+        deliverFromLine(&tx2rx, now);
+        deliverFromLine(&rx2tx, now);
+        replayDue(now);
+
+        updateReadInterest(epollFd, &tx2rx, EVENT_TX);
+        updateReadInterest(epollFd, &rx2tx, EVENT_RX);
+        armLineTimer(lineTimerFd);
+        armReplayTimer(replayTimerFd);
+        fflush(stdout);
+    }
+
+    close(epollFd);
+    close(lineTimerFd);
+    close(statsTimerFd);
+    close(scenarioTimerFd);
+    close(replayTimerFd);
+    free(replayChunks);
+    free(replayData);
+    for (int d = 0; d < 2; d++)
+    {
+        // Open even if splice() turned out not to be supported
+        for (int end = 0; end < 2; end++)
+        {
+            if (dirs[d]->pipe[end] >= 0)
+                close(dirs[d]->pipe[end]);
+        }
+    }
+
+    // Remove the serial ports
+    unlink(txPort);
+    unlink(rxPort);
+    close(slaveTx);
+    close(slaveRx);
+    close(fdTx);
+    close(fdRx);
+
+    printTrafficSummary(&tx2rx, (double)(nowNs() - lastSummary) / NS_PER_SEC);
+    printTrafficSummary(&rx2tx, (double)(nowNs() - lastSummary) / NS_PER_SEC);
+    printNoiseStatistics(&tx2rx);
+    printNoiseStatistics(&rx2tx);
 
-    system("killall socat");
+    if (captureFile != NULL)
+        fclose(captureFile);
 
     return 0;
 }
@@ -0,0 +1,55 @@
+// Byte ring header.
+// Bounded single-producer single-consumer queue of bytes. The producer and
+// the consumer only share two atomic positions, and only take the lock to
+// sleep when the ring is full or empty, or to wake the other side up.
+
+#ifndef _BYTE_RING_H_
+#define _BYTE_RING_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct
+{
+    unsigned char *data;
+    size_t capacity; // A power of two
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // Bytes ever committed, moved by the producer
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // Bytes ever released, moved by the consumer
+    _Alignas(CACHE_LINE_SIZE) atomic_int sleeping; // Sides waiting on "wake"
+    atomic_int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} ByteRing;
+
+// Allocate a ring of "capacity" bytes, a power of two.
+// Return "0" on success or "-1" on error.
+int startByteRing(ByteRing *ring, size_t capacity);
+void freeByteRing(ByteRing *ring);
+
+// Wake up both sides for good: waits return at once from then on.
+void closeByteRing(ByteRing *ring);
+
+size_t ringUsed(ByteRing *ring);
+
+// Producer: contiguous free space at the head, then the bytes written to it.
+size_t ringSpace(ByteRing *ring, unsigned char **span);
+void ringCommit(ByteRing *ring, size_t size);
+
+// Consumer: contiguous data at the tail, then the bytes done with.
+size_t ringData(ByteRing *ring, const unsigned char **span);
+void ringRelease(ByteRing *ring, size_t size);
+
+// Copy size bytes in or out, across the end of the ring. There must be
+// that much space, or data, already.
+void ringPut(ByteRing *ring, const void *data, size_t size);
+void ringGet(ByteRing *ring, void *data, size_t size);
+
+// Wait up to timeoutMs milliseconds, or for ever if negative, for size bytes
+// of space or of data. Return "1" once there are, "0" otherwise.
+int ringWaitSpace(ByteRing *ring, size_t size, int timeoutMs);
+int ringWaitData(ByteRing *ring, size_t size, int timeoutMs);
+
+#endif // _BYTE_RING_H_
@@ -0,0 +1,62 @@
+// Content-defined chunk store header.
+// The transmitter cuts files into chunks where a gear hash of the last bytes
+// meets a condition, as FastCDC does, so that the same content makes the same
+// chunks wherever it is in whatever file. The receiver keeps the chunks it
+// receives in a store, one file per chunk named by its XXH64 hash, and the
+// transmitter asks it which chunks it has before sending them.
+
+#ifndef _CHUNK_STORE_H_
+#define _CHUNK_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "packet.h"
+
+// Chunks are 8 KiB on average, within these.
+#define CHUNK_MIN_SIZE (2 * 1024)
+#define CHUNK_AVG_SIZE (8 * 1024)
+#define CHUNK_MAX_SIZE (64 * 1024)
+
+// Query: [11, L2, L1, 8-byte offset of the first chunk, chunks of an 8-byte
+// hash and a 4-byte size]. Answer: [11, L2, L1, bitmap of the chunks stored].
+#define CHUNK_ENTRY_SIZE 12
+#define CHUNKS_PER_QUERY ((MAX_PAYLOAD_SIZE - 11) / CHUNK_ENTRY_SIZE)
+
+// Chunk reference: [12, L2, L1, 8-byte offset, 8-byte hash, 4-byte size].
+#define CHUNK_REF_SIZE 23
+
+typedef struct
+{
+    off_t offset;
+    int size;
+    uint64_t hash;
+    int stored; // The receiver has it
+} Chunk;
+
+// Directory of the store, from the RX_CHUNK_STORE environment variable.
+typedef struct
+{
+    char path[4096];
+} ChunkStore;
+
+// Size of the chunk that starts data, of size bytes.
+size_t nextChunk(const unsigned char *data, size_t size);
+
+// Open the store named by RX_CHUNK_STORE, creating it if need be.
+// Return "0" on success or "-1" if there is none.
+int openChunkStore(ChunkStore *store);
+
+// Return "1" if the store has the chunk, else "0".
+int hasChunk(const ChunkStore *store, uint64_t hash, int size);
+
+// Read a stored chunk into data, checking its hash.
+// Return "0" on success or "-1" on error.
+int loadChunk(const ChunkStore *store, uint64_t hash, int size, unsigned char *data);
+
+// Add a chunk to the store.
+// Return "0" on success or "-1" on error.
+int saveChunk(const ChunkStore *store, uint64_t hash, const unsigned char *data, int size);
+
+#endif // _CHUNK_STORE_H_
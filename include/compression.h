@@ -0,0 +1,89 @@
+// Block compression header.
+// Files are compressed in independent blocks, by a pool of threads on
+// either side of the link, so that several blocks are packed or unpacked
+// at once while the link carries another. A packed block is
+// [method, 3-byte raw size, 3-byte payload size, payload].
+
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "file_hash.h"
+#include "lz.h"
+
+// Methods of packed blocks, offered in the start packet as a mask of 1 << method.
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ 1
+
+// Blocks match the verification blocks, so that a resume starts with one.
+#define COMPRESS_BLOCK_SIZE HASH_BLOCK_SIZE
+#define PACKED_HEADER_SIZE 7
+#define PACKED_BLOCK_MAX (PACKED_HEADER_SIZE + LZ_BOUND(COMPRESS_BLOCK_SIZE))
+
+// Packed data packet: [8, L2, L1, 8-byte offset of the block, 3-byte position in the packed block, data]
+#define PACKED_DATA_HEADER_SIZE 14
+
+#define MAX_COMPRESS_THREADS 8
+#define COMPRESS_JOBS (2 * MAX_COMPRESS_THREADS)
+
+typedef struct
+{
+    off_t offset;          // Offset of the block in the file
+    int rawSize;           // -1 if the block could not be unpacked
+    int packedSize;        // -1 if the block could not be read
+    int done;
+    unsigned char *raw;    // COMPRESS_BLOCK_SIZE bytes
+    unsigned char *packed; // PACKED_BLOCK_MAX bytes
+} CompressJob;
+
+// Jobs are handed to the threads and taken back in the same order.
+typedef struct
+{
+    int fd;     // File the blocks to pack are read from, -1 to unpack
+    int threadCount;
+    pthread_t threads[MAX_COMPRESS_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t queued;   // A job was submitted
+    pthread_cond_t finished; // A job is done
+    long submitted; // Jobs submitted so far
+    long started;   // Jobs taken by a thread so far
+    long taken;     // Jobs taken back so far
+    int stop;
+    CompressJob jobs[COMPRESS_JOBS];
+} BlockPool;
+
+// Methods the transmitter offers, from the TX_COMPRESS environment
+// variable: "lz" (default) or "off".
+int offeredCompression();
+
+// Pack size bytes of a block into packed, raw when it does not compress.
+// Return the size of the packed block.
+int packBlock(const unsigned char *raw, int size, unsigned char *packed);
+
+// Size of the packed block whose first "available" bytes are in packed, or
+// "-1" while its header is incomplete.
+int packedBlockSize(const unsigned char *packed, int available);
+
+// Unpack a packed block of size bytes into raw.
+// Return the size of the block, or "-1" if it is malformed.
+int unpackBlock(const unsigned char *packed, int size, unsigned char *raw);
+
+// Start threads that pack the blocks of fd, or unpack blocks if fd is -1.
+// Return "0" on success or "-1" on error.
+int startBlockPool(BlockPool *pool, int fd);
+
+// The job to fill and submit next, or NULL while every job is in use.
+CompressJob *freeJob(BlockPool *pool);
+void submitJob(BlockPool *pool);
+
+// The oldest job submitted, once it is done, waiting for it unless "wait" is
+// 0. NULL if there is none, or it is not done yet and "wait" is 0.
+CompressJob *finishedJob(BlockPool *pool, int wait);
+void releaseJob(BlockPool *pool);
+
+// Stop the threads and free the jobs.
+void stopBlockPool(BlockPool *pool);
+
+#endif // _COMPRESSION_H_
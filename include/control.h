@@ -0,0 +1,95 @@
+// Control packets header.
+// Control packets are [C, T, L, V, T, L, V, ...]: a control field and a list
+// of fields of type T and L bytes of value V. Fields a peer does not know, or
+// does not expect at that length, are skipped, so that newer peers can add
+// fields without breaking older ones of this format (see README.md for the
+// peers it is not compatible with). The transmitter offers the settings of
+// a file in the start packet, the receiver answers with those it accepts in
+// the resume packet.
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "packet.h"
+
+// Settings of a file, from the start or end packet.
+typedef struct
+{
+    off_t size;
+    char name[256];
+    int hashed;      // The end packet carries the root hash of the file
+    uint64_t hash;
+    int compression; // Methods offered, as a mask of 1 << method
+    int delta;       // A delta is offered
+    int chunks;      // Chunks are offered
+    int timed;       // The modification time of the file is known
+    int64_t mtime;
+    long mtimeNsec;
+} FileSettings;
+
+// Settings the receiver accepts, from the resume packet.
+typedef struct
+{
+    off_t offset;
+    int compression;    // Method accepted, COMPRESS_NONE if none
+    int basisBlockSize; // Basis of the receiver for a delta, 0 if none
+    off_t basisSize;
+    uint64_t basisRoot;
+    int chunks;         // The receiver has a chunk store
+} AcceptedSettings;
+
+typedef struct
+{
+    int type;
+    int length;
+    const unsigned char *value;
+} ControlField;
+
+typedef struct
+{
+    unsigned char *packet;
+    int size;
+    int capacity;
+} ControlBuilder;
+
+typedef struct
+{
+    const unsigned char *packet;
+    int size;
+    int position;
+} ControlParser;
+
+// Write value in size bytes, most significant first, and read it back.
+void putValue(unsigned char *p, uint64_t value, int size);
+uint64_t getValue(const unsigned char *p, int size);
+
+// Start a control packet in the capacity bytes of packet.
+void startControl(ControlBuilder *builder, unsigned char *packet, int capacity, int control);
+
+// Add a field. Numbers take "length" bytes, or as few as they need if it is 0.
+// Return "0" on success or "-1" if the packet is full.
+int addField(ControlBuilder *builder, int type, const void *value, int length);
+int addNumberField(ControlBuilder *builder, int type, uint64_t value, int length);
+
+// Walk the fields of a control packet of size bytes.
+// Return "1" with the next field, "0" at the end or "-1" if it is malformed.
+void startParser(ControlParser *parser, const unsigned char *packet, int size);
+int nextField(ControlParser *parser, ControlField *field);
+
+// Send a start or end packet with the settings of a file.
+// Return "0" on success or "-1" on error.
+int buildControlPacket(int control, const FileSettings *settings);
+
+// Read the settings of a start or end packet of size bytes.
+// Return "0" on success or "-1" if it is malformed.
+int parseControlPacket(const unsigned char *packet, int size, FileSettings *settings);
+
+// Send, or wait for, the resume packet of the receiver.
+// Return "0" on success or "-1" on error.
+int buildResumePacket(const AcceptedSettings *settings);
+int readResumePacket(AcceptedSettings *settings);
+
+#endif // _CONTROL_H_
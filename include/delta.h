@@ -0,0 +1,66 @@
+// Delta transfer header.
+// The receiver describes the copy of a file it already has, its basis, by
+// the signatures of its blocks: a weak checksum that rolls over the data one
+// byte at a time, and the XXH64 hash of the block. The transmitter looks for
+// the blocks of the basis at every offset of its own file, as rsync does,
+// and sends references to the blocks it finds instead of their data.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "packet.h"
+
+// Blocks of the basis are about the square root of its size, within these.
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK (64 * 1024)
+
+// The file made from a delta is written next to its basis, which it
+// replaces once it is verified.
+#define DELTA_SUFFIX ".part"
+
+// Signature in a SIGNATURES packet: 4-byte weak checksum, 8-byte hash.
+#define SIGNATURE_SIZE 12
+#define SIGNATURES_PER_PACKET ((MAX_PAYLOAD_SIZE - 3) / SIGNATURE_SIZE)
+
+typedef struct
+{
+    uint32_t weak;
+    uint64_t strong;
+} BlockSignature;
+
+typedef struct
+{
+    int fd;
+    off_t size;
+    int blockSize;
+    uint64_t root; // Root hash of the whole basis, as verification makes it
+    int count;     // Signatures of the whole blocks of the basis
+    BlockSignature *signatures;
+} Basis;
+
+// Where the transmitter sends the delta, in the order of its file.
+typedef struct
+{
+    int (*literal)(void *context, off_t offset, off_t size);
+    int (*copy)(void *context, off_t offset, off_t basisOffset, off_t size);
+    void *context;
+} DeltaOutput;
+
+// Rolling checksum of a block of data.
+uint32_t weakChecksum(const unsigned char *data, int size);
+
+// Open "filename" as a basis and read its signatures.
+// Return "0" on success or "-1" on error.
+int openBasis(Basis *basis, const char *filename);
+void closeBasis(Basis *basis);
+
+// Find the blocks of a basis in size bytes of data, and hand the delta
+// from it to "output" as runs of literal data and copies of the basis.
+// Return "0" on success or the first "-1" returned by output.
+int computeDelta(const unsigned char *data, off_t size, const BlockSignature *signatures, int count,
+                 int blockSize, const DeltaOutput *output);
+
+#endif // _DELTA_H_
@@ -0,0 +1,95 @@
+// End-to-end file verification header.
+// Files are hashed in blocks with XXH64 as their data goes by. The
+// transmitter sends the hashes of its blocks in HASHES packets, and a root
+// hash over all of them in the end packet. The receiver compares them with
+// the hashes of the blocks it wrote and asks again for the blocks that differ.
+
+#ifndef _FILE_HASH_H_
+#define _FILE_HASH_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "packet.h"
+#include "xxhash.h"
+
+// Unit of verification and of re-sending.
+#define HASH_BLOCK_SIZE (64 * 1024)
+
+// Hashes in a HASHES packet, items in a VERIFY packet.
+#define HASHES_PER_PACKET ((MAX_PAYLOAD_SIZE - DATA_HEADER_SIZE) / 8)
+#define ITEMS_PER_PACKET ((MAX_PAYLOAD_SIZE - 3) / 8)
+
+// VERIFY item asking for the whole file again: the hashes did not add up.
+#define VERIFY_RESTART UINT64_MAX
+
+// Hash of one block of a file.
+typedef struct
+{
+    off_t offset;
+    uint64_t hash;
+} BlockHash;
+
+typedef struct
+{
+    int count;
+    int capacity;
+    BlockHash *blocks;
+} BlockHashList;
+
+// Items of VERIFY packets: offsets of blocks or positions of files.
+typedef struct
+{
+    int count;
+    int capacity;
+    uint64_t *items;
+} VerifyList;
+
+// Hashes the blocks of a file from data received in order.
+typedef struct
+{
+    off_t fileSize;
+    off_t next; // Offset expected next in the current block, -1 if any was missed
+    Xxh64State state;
+} BlockHasher;
+
+// Receiver side verification of one file.
+typedef struct
+{
+    BlockHasher hasher;
+    BlockHashList pending; // Blocks written, whose hash was not announced yet
+    BlockHashList bad;     // Blocks to get again, with the hash they should have
+    Xxh64State root;       // Over the hashes announced by the transmitter
+    off_t announced;       // Bytes of the file covered by announced hashes
+} Verifier;
+
+// Root hash over a list of block hashes, in their order.
+void rootUpdate(Xxh64State *root, uint64_t hash);
+
+void startBlockHasher(BlockHasher *hasher, off_t fileSize);
+
+// Hash size bytes of data found at offset. Return "1" when they complete a
+// block, whose hash is then in "block", else "0".
+int hashBlockData(BlockHasher *hasher, off_t offset, const unsigned char *data, size_t size, BlockHash *block);
+
+int addBlockHash(BlockHashList *list, off_t offset, uint64_t hash);
+void freeBlockHashList(BlockHashList *list);
+
+int addVerifyItem(VerifyList *list, uint64_t item);
+void freeVerifyList(VerifyList *list);
+
+void startVerifier(Verifier *verifier, off_t fileSize);
+void freeVerifier(Verifier *verifier);
+
+// Account for size bytes of data written at offset.
+void verifyData(Verifier *verifier, off_t offset, const unsigned char *data, size_t size);
+
+// Compare the "count" hashes announced from the block at offset on.
+void verifyHashes(Verifier *verifier, off_t offset, const unsigned char *hashes, int count);
+
+// Check the whole file against the root hash of the end packet.
+// Return the number of blocks to get again, or "-1" when the whole file
+// must be sent again.
+int verifyEnd(Verifier *verifier, uint64_t root);
+
+#endif // _FILE_HASH_H_
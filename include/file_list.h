@@ -0,0 +1,24 @@
+// Transmitter file list header.
+
+#ifndef _FILE_LIST_H_
+#define _FILE_LIST_H_
+
+// Files sent in one session.
+typedef struct
+{
+    int count;
+    int capacity;
+    char **paths; // Where the files are read from
+    char **names; // Names sent to the receiver, relative paths
+} FileList;
+
+// List the files to send for "source", which is one of:
+//   a file, sent under its own name;
+//   a directory, whose regular files are all sent under "directory/...";
+//   "@manifest", a text file with the path of one file per line.
+// Return "0" on success or "-1" on error.
+int buildFileList(const char *source, FileList *list);
+
+void freeFileList(FileList *list);
+
+#endif // _FILE_LIST_H_
@@ -0,0 +1,65 @@
+// Transmitter file reader header.
+
+#ifndef _FILE_READER_H_
+#define _FILE_READER_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "packet.h"
+
+// Number of data packets read ahead of the link.
+#define READ_AHEAD_PACKETS 64
+
+// Pages of the mapping already sent are dropped every this many bytes, so
+// that the memory used stays bounded however large the file is.
+#define DROP_BEHIND_SIZE (8 << 20)
+
+// Data packet [1, L2, L1, offset, data]. The data is a slice of the mapped
+// file, or the packet's own storage when it was filled by the reader thread.
+typedef struct
+{
+    unsigned char header[DATA_HEADER_SIZE];
+    const unsigned char *data;
+    int size; // Packet size, 0 at the end of the file or -1 on a read error
+    unsigned char storage[MAX_DATA_SIZE];
+} PacketBuffer;
+
+typedef struct
+{
+    int fd;
+    off_t fileSize;
+    const unsigned char *map; // Whole file, when it could be mapped
+    off_t offset;             // Next byte of the file to send
+    off_t dropped;            // Bytes of the mapping dropped once sent
+    int started; // Reader thread running
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    int head;  // Oldest packet not yet released by the link
+    int count; // Packets read and not yet released
+    int stop;
+    PacketBuffer ring[READ_AHEAD_PACKETS];
+} FileReader;
+
+// Open "filename". Regular files are mapped and sent straight from the
+// mapping, others are read ahead of the link by a reader thread.
+// Return "0" on success or "-1" on error.
+int openFileReader(FileReader *reader, const char *filename);
+
+// Start reading data packets from "offset" on.
+// Return "0" on success or "-1" on error.
+int startFileReader(FileReader *reader, off_t offset);
+
+// Wait for the next data packet. Its size is 0 at the end of the file and
+// -1 on a read error. The packet stays valid until releasePacket().
+const PacketBuffer *nextPacket(FileReader *reader);
+
+// Release the oldest packet, once the link is done with it.
+void releasePacket(FileReader *reader);
+
+// Stop the reader thread, if it was started, and close the file.
+void closeFileReader(FileReader *reader);
+
+#endif // _FILE_READER_H_
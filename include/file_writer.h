@@ -0,0 +1,85 @@
+// Receiver file writer header.
+
+#ifndef _FILE_WRITER_H_
+#define _FILE_WRITER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Data is collected in aligned buffers of this size before it is written.
+#define WRITE_BUFFER_SIZE (1 << 20)
+#define WRITE_BUFFERS 4
+
+// A buffer is written, and the checkpoint moved, at least this often.
+#define CHECKPOINT_SECONDS 5
+
+// Checkpoint sidecar: "<file>.ckpt", removed once the file is complete.
+#define CHECKPOINT_SUFFIX ".ckpt"
+#define CHECKPOINT_MAGIC "RCOMCKP1"
+
+// When the received file is flushed to the disk, from the RX_FSYNC
+// environment variable: "never" (default), "close" or "always" (every buffer).
+typedef enum
+{
+    FsyncNever,
+    FsyncOnClose,
+    FsyncAlways,
+} FsyncPolicy;
+
+// Checkpoint record: the first "persisted" bytes of a file of "size" bytes
+// are on the disk. Fields in host byte order, the sidecar never travels.
+typedef struct
+{
+    char magic[8];
+    uint64_t size;
+    uint64_t persisted;
+} Checkpoint;
+
+typedef struct
+{
+    unsigned char *data;
+    size_t used;
+    off_t offset; // Offset of the buffer in the file
+} WriteBuffer;
+
+typedef struct
+{
+    int fd;
+    int checkpointFd;
+    FsyncPolicy fsyncPolicy;
+    off_t announcedSize;
+    off_t nextOffset; // Offset in the file right after the last data received
+    off_t endOffset;  // Largest offset received so far
+    off_t persisted;  // Bytes from the start of the file known to be written
+    time_t bufferStarted;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    int head;   // Oldest buffer handed to the writer thread
+    int queued; // Buffers handed to the writer thread, the next one is filled
+    int stop;
+    int error;  // errno of the first failed write, or 0
+    char checkpointName[4096];
+    WriteBuffer ring[WRITE_BUFFERS];
+} FileWriter;
+
+// Open "filename" for a file of "announcedSize" bytes and reserve its space.
+// Unless "resumeOffset" is NULL, the file keeps a checkpoint: when one of an
+// earlier transfer of the same file is found, the file is kept and
+// "resumeOffset" is set to the bytes already on the disk.
+// Return "0" on success or "-1" on error.
+int openFileWriter(FileWriter *writer, const char *filename, off_t announcedSize, off_t *resumeOffset);
+
+// Write size bytes of data at "offset" in the file, from another thread.
+// Return "0" on success or "-1" if a previous write failed.
+int writeData(FileWriter *writer, off_t offset, const unsigned char *data, size_t size);
+
+// Write what is left and close the file. A "complete" file is trimmed to the
+// data received and loses its checkpoint, others keep it for a later resume.
+// Return "0" on success or "-1" if any write failed.
+int closeFileWriter(FileWriter *writer, int complete);
+
+#endif // _FILE_WRITER_H_
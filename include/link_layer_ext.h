@@ -0,0 +1,23 @@
+// Link layer extensions header.
+// Calls beyond the interface of link_layer.h, which must not be changed.
+
+#ifndef _LINK_LAYER_EXT_H_
+#define _LINK_LAYER_EXT_H_
+
+#include <sys/uio.h>
+
+#include "link_layer.h"
+
+// Send the concatenation of the iovcnt buffers in iov as one frame, without
+// gathering them first. At most MAX_PAYLOAD_SIZE bytes in total.
+// Return number of chars written, or "-1" on error.
+int llwritev(const struct iovec *iov, int iovcnt);
+
+// Measure the line with echo frames, on the transmitter right after llopen,
+// and fit the size of the frames and their timeout to it. The application
+// only calls it when TX_CALIBRATE is "on".
+// Return "0" on success, or "-1" if too few echoes came back, and the
+// defaults stay.
+int llcalibrate();
+
+#endif // _LINK_LAYER_EXT_H_
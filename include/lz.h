@@ -0,0 +1,26 @@
+// LZ block codec header.
+// Blocks are coded as sequences of [token, literal length, literals,
+// 2-byte offset, match length] in the manner of LZ4. The token holds the
+// literal length and the match length less LZ_MIN_MATCH in 4 bits each,
+// both continued in bytes of 255 when they reach 15. The last sequence has
+// literals only.
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Room for the worst case, when nothing matches.
+#define LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+// Compress size bytes of src into dst.
+// Return the compressed size, or "0" if it does not fit in capacity bytes.
+int lzCompress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+
+// Decompress size bytes of src into dst.
+// Return the decompressed size, or "-1" if src is malformed or does not fit
+// in capacity bytes.
+int lzDecompress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+
+#endif // _LZ_H_
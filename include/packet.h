@@ -0,0 +1,47 @@
+// Application packets header.
+
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include "link_layer.h"
+
+// Control field of the application packets
+#define PACKET_DATA 1
+#define PACKET_START 2
+#define PACKET_END 3
+#define PACKET_RESUME 4 // Rx to Tx: settings accepted for the file, see control.h
+#define PACKET_HASHES 5 // [5, L2, L1, 8-byte offset of the first block, 8-byte block hashes]
+#define PACKET_VERIFY 6 // Rx to Tx: [6, L2, L1, 8-byte items] to send again,
+                        // a full packet is followed by another one
+#define PACKET_CHECK 7  // [7]: end of a round of small files, answered by VERIFY
+#define PACKET_PACKED 8 // Compressed data, see compression.h
+#define PACKET_SIGNATURES 9 // Tx to Rx: [9] asks for the signatures of the basis, see delta.h
+                            // Rx to Tx: [9, L2, L1, signatures], a full packet is followed by another one
+#define PACKET_COPY 10      // [10, L2, L1, 8-byte offset, 8-byte offset in the basis, 8-byte size]
+#define PACKET_HAVE 11      // Chunks the receiver has, see chunk_store.h
+#define PACKET_CHUNK 12     // Reference to a chunk the receiver has
+
+// Control packet fields: [2|3|4, T, L, value, ...]
+#define FIELD_SIZE 0
+#define FIELD_OFFSET 0 // Resume packet: offset to resume the file from
+#define FIELD_NAME 1
+#define FIELD_HASH 2 // End packet: root hash of the file
+#define FIELD_COMPRESSION 3 // Start packet: methods offered, resume packet: method accepted
+#define FIELD_DELTA 4       // Start packet: delta offered, resume packet: [4-byte block size,
+                            // 8-byte size, 8-byte root hash] of the basis the receiver has
+#define FIELD_CHUNKS 5      // Start packet: chunks offered, resume packet: chunk store accepted
+#define FIELD_MTIME 6       // Start packet: [8-byte seconds, 4-byte nanoseconds] of the last change
+
+// Data packet: [1, L2, L1, 8-byte offset in the file, data]
+#define DATA_HEADER_SIZE 11
+#define MAX_DATA_SIZE (MAX_PAYLOAD_SIZE - DATA_HEADER_SIZE)
+#define COPY_PACKET_SIZE 27
+
+// Smaller files are sent without a RESUME packet: starting them over costs
+// less than turning the link around for every one of them.
+#define RESUME_MIN_SIZE (64 * 1024)
+
+// Rounds of re-sending what failed verification before giving up.
+#define MAX_VERIFY_ROUNDS 3
+
+#endif // _PACKET_H_
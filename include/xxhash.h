@@ -0,0 +1,26 @@
+// XXH64 hash header.
+
+#ifndef _XXHASH_H_
+#define _XXHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming state, for data that goes by in pieces.
+typedef struct
+{
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t bufferSize;
+    uint64_t seed;
+} Xxh64State;
+
+void xxh64Reset(Xxh64State *state, uint64_t seed);
+void xxh64Update(Xxh64State *state, const void *data, size_t size);
+uint64_t xxh64Digest(const Xxh64State *state);
+
+// Hash of size bytes of data, in one call.
+uint64_t xxh64(const void *data, size_t size, uint64_t seed);
+
+#endif // _XXHASH_H_
@@ -0,0 +1,614 @@
+// Discrete-event simulation of the serial port project.
+// Runs the transmitter and the receiver application layers as two threads of
+// one process, over a simulated serial line driven by a virtual clock. The
+// clock only advances when both peers are waiting for the line, so hours of
+// transfer at low bit rates are simulated in milliseconds.
+//
+// The link layer is compiled unchanged against sim.h, which replaces
+// read / write / alarm / setitimer / signal / nanosleep / gettimeofday and
+// the termios calls.
+//
+// Build (the project Makefile only builds the real programs):
+//   gcc -Wall -O2 -DLL_SIM -Iinclude -Isim -o bin/sim sim/sim.c src/*.c -lpthread
+//
+// The receiver runs in a directory of its own (--out), so that it never
+// writes over the files being sent. Every file sent is hashed before the
+// run, and after it both the source and what the receiver wrote must still
+// have that hash: the exit status is 1 otherwise.
+//
+// Usage: bin/sim [options] filename
+
+#define _GNU_SOURCE // unshare()
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "application_layer.h"
+#include "file_list.h"
+#include "xxhash.h"
+#include "sim.h"
+
+// Path the receiver writes a file to, from its name (application_layer.c).
+void receivedName(unsigned char *name);
+
+#define FALSE 0
+#define TRUE 1
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+// Maximum number of bytes in flight towards each peer.
+#define CHANNEL_SIZE (1 << 20)
+
+// File descriptor of each end of the line.
+#define SIM_FD_BASE 100
+
+// One end of the line: a peer thread and the bytes travelling towards it.
+typedef struct
+{
+    int attached;
+    int waiting; // Blocked in sim_read(), until data or an alarm is due
+    int vmin;    // VMIN of the port: 0 returns 0 on alarms
+    int restart; // Blocking reads restart after the alarm handler, else EINTR
+    uint64_t alarmAt;
+    uint64_t wakeAt; // In sim_nanosleep() until then, or 0
+    void (*handler)(int);
+
+    unsigned char data[CHANNEL_SIZE];
+    uint64_t arrival[CHANNEL_SIZE];
+    size_t head;
+    size_t count;
+    uint64_t lineFreeAt; // Time at which the sender's last bit leaves
+
+    unsigned long long bytes;
+    unsigned long long dropped;
+    unsigned long bitErrors;
+} Peer;
+
+static Peer peers[2]; // 0 is Tx, 1 is Rx
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t simWake = PTHREAD_COND_INITIALIZER;
+static uint64_t now = 0;
+static int attached = 0;
+static int waiting = 0;
+static _Thread_local int side = -1;
+
+// Line settings
+static long baudRate = 9600;
+static int bitsPerByte = 10;
+static double delayMs = 0;
+static double ber = 0;
+static uint64_t randomState = 0x9E3779B97F4A7C15ULL;
+
+// Returns: uniformly distributed random number in [0, 1).
+static double nextRandom()
+{
+    // xorshift64*
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return ((randomState * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Returns: TRUE if the waiting peer "p" has something to do at "now".
+static int isRunnable(const Peer *p)
+{
+    if (p->wakeAt > 0)
+        return p->wakeAt <= now;
+    return (p->count > 0 && p->arrival[p->head] <= now) || (p->alarmAt > 0 && p->alarmAt <= now);
+}
+
+// Advance the virtual clock to the next event and wake the peers it concerns.
+// Called with "simLock" held, when every attached peer is waiting.
+static void advanceClock()
+{
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < 2; i++)
+    {
+        Peer *p = &peers[i];
+        if (!p->attached || !p->waiting)
+            continue;
+        if (p->wakeAt > 0)
+        {
+            if (p->wakeAt < next)
+                next = p->wakeAt;
+            continue;
+        }
+        if (p->count > 0 && p->arrival[p->head] < next)
+            next = p->arrival[p->head];
+        if (p->alarmAt > 0 && p->alarmAt < next)
+            next = p->alarmAt;
+    }
+
+    if (next == UINT64_MAX)
+    {
+        fprintf(stderr, "Simulation deadlock at t=%.3f s: every peer waits for a line that stays silent\n",
+                (double)now / NS_PER_SEC);
+        exit(EXIT_FAILURE);
+    }
+
+    if (next > now)
+        now = next;
+
+    for (int i = 0; i < 2; i++)
+    {
+        Peer *p = &peers[i];
+        if (p->attached && p->waiting && isRunnable(p))
+        {
+            p->waiting = FALSE;
+            waiting--;
+        }
+    }
+
+    pthread_cond_broadcast(&simWake);
+}
+
+// Both peers are attached before their threads start, so that the first one
+// to wait for the line does not advance the clock on its own.
+static void attachPeers()
+{
+    for (int i = 0; i < 2; i++)
+        peers[i].attached = TRUE;
+    attached = 2;
+}
+
+static void detachPeer()
+{
+    pthread_mutex_lock(&simLock);
+    peers[side].attached = FALSE;
+    attached--;
+    if (attached > 0 && waiting == attached)
+        advanceClock();
+    pthread_mutex_unlock(&simLock);
+}
+
+int sim_open(const char *path, int flags)
+{
+    return SIM_FD_BASE + side;
+}
+
+int sim_close(int fd)
+{
+    return 0;
+}
+
+ssize_t sim_read(int fd, void *buf, size_t count)
+{
+    Peer *p = &peers[side];
+    unsigned char *bytes = buf;
+
+    pthread_mutex_lock(&simLock);
+
+    while (TRUE)
+    {
+        size_t n = 0;
+        while (n < count && p->count > 0 && p->arrival[p->head] <= now)
+        {
+            bytes[n++] = p->data[p->head];
+            p->head = (p->head + 1) % CHANNEL_SIZE;
+            p->count--;
+        }
+
+        if (n > 0)
+        {
+            pthread_mutex_unlock(&simLock);
+            return n;
+        }
+
+        if (p->alarmAt > 0 && p->alarmAt <= now)
+        {
+            void (*handler)(int) = p->handler;
+            p->alarmAt = 0;
+            pthread_mutex_unlock(&simLock);
+
+            if (handler != NULL && handler != SIG_IGN && handler != SIG_DFL)
+                handler(SIGALRM);
+
+            // A non-blocking port returns, a blocking one restarts the read
+            // unless the handler was installed without SA_RESTART
+            if (p->vmin == 0)
+                return 0;
+            if (!p->restart)
+            {
+                errno = EINTR;
+                return -1;
+            }
+
+            pthread_mutex_lock(&simLock);
+            continue;
+        }
+
+        p->waiting = TRUE;
+        waiting++;
+        if (waiting == attached)
+            advanceClock();
+
+        while (p->waiting)
+            pthread_cond_wait(&simWake, &simLock);
+    }
+}
+
+ssize_t sim_write(int fd, const void *buf, size_t count)
+{
+    const unsigned char *bytes = buf;
+    Peer *to = &peers[1 - side];
+    double byteNs = baudRate > 0 ? (double)bitsPerByte * NS_PER_SEC / baudRate : 0;
+
+    pthread_mutex_lock(&simLock);
+
+    uint64_t sent = to->lineFreeAt > now ? to->lineFreeAt : now;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned char byte = bytes[i];
+        for (int bit = 0; ber > 0 && bit < 8; bit++)
+        {
+            if (nextRandom() < ber)
+            {
+                byte ^= 1 << bit;
+                to->bitErrors++;
+            }
+        }
+
+        uint64_t arrival = sent + (uint64_t)(byteNs * (i + 1)) + (uint64_t)(delayMs * NS_PER_MS);
+
+        if (to->count == CHANNEL_SIZE)
+        {
+            to->dropped++;
+            continue;
+        }
+
+        size_t pos = (to->head + to->count) % CHANNEL_SIZE;
+        to->data[pos] = byte;
+        to->arrival[pos] = arrival;
+        to->count++;
+        to->bytes++;
+    }
+
+    to->lineFreeAt = sent + (uint64_t)(byteNs * count);
+
+    pthread_mutex_unlock(&simLock);
+    return count;
+}
+
+int sim_tcgetattr(int fd, struct termios *termios)
+{
+    memset(termios, 0, sizeof(*termios));
+    return 0;
+}
+
+int sim_tcsetattr(int fd, int actions, const struct termios *termios)
+{
+    pthread_mutex_lock(&simLock);
+    peers[side].vmin = termios->c_cc[VMIN];
+    pthread_mutex_unlock(&simLock);
+    return 0;
+}
+
+int sim_tcflush(int fd, int queue)
+{
+    Peer *p = &peers[side];
+
+    // Discard what already arrived, not what is still on the line
+    pthread_mutex_lock(&simLock);
+    while (p->count > 0 && p->arrival[p->head] <= now)
+    {
+        p->head = (p->head + 1) % CHANNEL_SIZE;
+        p->count--;
+    }
+    pthread_mutex_unlock(&simLock);
+    return 0;
+}
+
+unsigned int sim_alarm(unsigned int seconds)
+{
+    Peer *p = &peers[side];
+
+    pthread_mutex_lock(&simLock);
+    unsigned int remaining = p->alarmAt > now ? (p->alarmAt - now + NS_PER_SEC - 1) / NS_PER_SEC : 0;
+    p->alarmAt = seconds > 0 ? now + seconds * NS_PER_SEC : 0;
+    pthread_mutex_unlock(&simLock);
+
+    return remaining;
+}
+
+int sim_setitimer(int which, const struct itimerval *value, struct itimerval *old)
+{
+    Peer *p = &peers[side];
+    uint64_t delay = value->it_value.tv_sec * NS_PER_SEC + value->it_value.tv_usec * 1000ULL;
+
+    pthread_mutex_lock(&simLock);
+    if (old != NULL)
+    {
+        uint64_t remaining = p->alarmAt > now ? p->alarmAt - now : 0;
+        memset(old, 0, sizeof(*old));
+        old->it_value.tv_sec = remaining / NS_PER_SEC;
+        old->it_value.tv_usec = (remaining % NS_PER_SEC) / 1000;
+    }
+    p->alarmAt = delay > 0 ? now + delay : 0;
+    pthread_mutex_unlock(&simLock);
+
+    return 0;
+}
+
+void (*sim_signal(int signum, void (*handler)(int)))(int)
+{
+    void (*previous)(int) = peers[side].handler;
+
+    if (signum == SIGALRM)
+    {
+        peers[side].handler = handler;
+        peers[side].restart = TRUE;
+    }
+    return previous;
+}
+
+int sim_sigaction(int signum, const struct sigaction *action, struct sigaction *old)
+{
+    if (old != NULL)
+    {
+        memset(old, 0, sizeof(*old));
+        old->sa_handler = peers[side].handler;
+        old->sa_flags = peers[side].restart ? SA_RESTART : 0;
+    }
+    if (signum == SIGALRM && action != NULL)
+    {
+        peers[side].handler = action->sa_handler;
+        peers[side].restart = (action->sa_flags & SA_RESTART) != 0;
+    }
+    return 0;
+}
+
+int sim_nanosleep(const struct timespec *request, struct timespec *remaining)
+{
+    Peer *p = &peers[side];
+
+    pthread_mutex_lock(&simLock);
+    p->wakeAt = now + request->tv_sec * NS_PER_SEC + request->tv_nsec;
+    p->waiting = TRUE;
+    waiting++;
+    if (waiting == attached)
+        advanceClock();
+    while (p->waiting)
+        pthread_cond_wait(&simWake, &simLock);
+    p->wakeAt = 0;
+    pthread_mutex_unlock(&simLock);
+
+    return 0;
+}
+
+int sim_gettimeofday(struct timeval *tv, void *tz)
+{
+    pthread_mutex_lock(&simLock);
+    tv->tv_sec = now / NS_PER_SEC;
+    tv->tv_usec = (now % NS_PER_SEC) / 1000;
+    pthread_mutex_unlock(&simLock);
+    return 0;
+}
+
+////////////////////////////////////////////////
+// DRIVER
+////////////////////////////////////////////////
+
+typedef struct
+{
+    int peer;
+    const char *role;
+    const char *filename;
+    const char *directory; // Working directory of the peer, NULL for the current one
+    int nTries;
+    int timeout;
+} PeerArgs;
+
+static void *runPeer(void *arg)
+{
+    const PeerArgs *args = arg;
+
+    side = args->peer;
+
+    // The working directory is per process: the thread takes a copy first
+    if (args->directory != NULL && (unshare(CLONE_FS) == -1 || chdir(args->directory) == -1))
+    {
+        perror(args->directory);
+        exit(EXIT_FAILURE);
+    }
+    applicationLayer("/dev/sim", args->role, baudRate, args->nTries, args->timeout, args->filename);
+    detachPeer();
+
+    return NULL;
+}
+
+static void usage(const char *program)
+{
+    printf("Usage: %s [options] filename\n"
+           "  --baud BPS     bit rate of the line (default: 9600)\n"
+           "  --bits N       bits per byte on the line, 8N1 is 10 (default: 10)\n"
+           "  --delay MS     propagation delay in milliseconds (default: 0)\n"
+           "  --ber P        independent bit error probability (default: 0)\n"
+           "  --seed N       seed of the bit error generator (default: 0)\n"
+           "  --tries N      maximum number of frame retries (default: 3)\n"
+           "  --timeout S    frame timeout in seconds (default: 4)\n"
+           "  --out DIR      directory the receiver writes to (default: sim-received)\n",
+           program);
+}
+
+// Returns: XXH64 of the file at "path" in "hash", "0" on success or "-1".
+static int hashFile(const char *path, uint64_t *hash)
+{
+    FILE *file = fopen(path, "rb");
+    unsigned char data[65536];
+    size_t n;
+    Xxh64State state;
+
+    if (file == NULL)
+        return -1;
+    xxh64Reset(&state, 0);
+    while ((n = fread(data, 1, sizeof(data), file)) > 0)
+        xxh64Update(&state, data, n);
+    int failed = ferror(file);
+    fclose(file);
+    *hash = xxh64Digest(&state);
+    return failed ? -1 : 0;
+}
+
+// Returns: number of files whose source or received copy differs from the
+// hash the source had before the run.
+static int verifyFiles(const FileList *list, const uint64_t *hashes, const char *directory)
+{
+    int failures = 0;
+
+    for (int i = 0; i < list->count; i++)
+    {
+        unsigned char name[8192];
+        char path[8192 + 256];
+        uint64_t hash;
+
+        snprintf((char *)name, sizeof(name) - 16, "%s", list->names[i]);
+        receivedName(name);
+        snprintf(path, sizeof(path), "%s/%s", directory, (const char *)name);
+
+        if (hashFile(list->paths[i], &hash) == -1 || hash != hashes[i])
+        {
+            fprintf(stderr, "%s changed during the run\n", list->paths[i]);
+            failures++;
+        }
+        else if (hashFile(path, &hash) == -1 || hash != hashes[i])
+        {
+            fprintf(stderr, "%s differs from %s\n", path, list->paths[i]);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    PeerArgs tx = {.peer = 0, .role = "tx", .nTries = 3, .timeout = 4};
+    const char *filename = NULL;
+    const char *outDir = "sim-received";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--", 2) != 0)
+        {
+            filename = argv[i];
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            exit(1);
+        }
+
+        const char *option = argv[i] + 2;
+        const char *value = argv[++i];
+
+        if (strcmp(option, "baud") == 0)
+            baudRate = atol(value);
+        else if (strcmp(option, "bits") == 0)
+            bitsPerByte = atoi(value);
+        else if (strcmp(option, "delay") == 0)
+            delayMs = atof(value);
+        else if (strcmp(option, "ber") == 0)
+            ber = atof(value);
+        else if (strcmp(option, "seed") == 0)
+            randomState = (strtoull(value, NULL, 0) * 0x9E3779B97F4A7C15ULL) | 1;
+        else if (strcmp(option, "tries") == 0)
+            tx.nTries = atoi(value);
+        else if (strcmp(option, "timeout") == 0)
+            tx.timeout = atoi(value);
+        else if (strcmp(option, "out") == 0)
+            outDir = value;
+        else
+        {
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (filename == NULL || baudRate < 0 || bitsPerByte <= 0 || delayMs < 0 || ber < 0 || ber > 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    // Bytes sent, over every file of a directory or manifest, and the hash
+    // of every file before the run
+    FileList list;
+    long long fileSize = 0;
+    if (buildFileList(filename, &list) == -1)
+    {
+        perror(filename);
+        exit(1);
+    }
+    uint64_t *hashes = calloc(list.count > 0 ? list.count : 1, sizeof(uint64_t));
+    if (hashes == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < list.count; i++)
+    {
+        struct stat st;
+        if (stat(list.paths[i], &st) == 0)
+            fileSize += st.st_size;
+        if (hashFile(list.paths[i], &hashes[i]) == -1)
+        {
+            perror(list.paths[i]);
+            exit(1);
+        }
+    }
+
+    if (mkdir(outDir, 0755) == -1 && errno != EEXIST)
+    {
+        perror(outDir);
+        exit(1);
+    }
+
+    tx.filename = filename;
+    PeerArgs rx = tx;
+    rx.peer = 1;
+    rx.role = "rx";
+    rx.directory = outDir;
+
+    struct timespec wallStart;
+    struct timespec wallEnd;
+    clock_gettime(CLOCK_MONOTONIC, &wallStart);
+
+    attachPeers();
+
+    pthread_t threads[2];
+    pthread_create(&threads[1], NULL, runPeer, &rx);
+    pthread_create(&threads[0], NULL, runPeer, &tx);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+    double wall = (wallEnd.tv_sec - wallStart.tv_sec) + (wallEnd.tv_nsec - wallStart.tv_nsec) * 1e-9;
+    double simulated = (double)now / NS_PER_SEC;
+    double transferRate = simulated > 0 ? fileSize * 8 / simulated : 0;
+
+    printf("\nSimulated %.3f s in %.3f s of real time\n", simulated, wall);
+    printf("CPU Time Used: %f seconds\n", simulated);
+    printf("Transfer Rate: %f bits/s\n", transferRate);
+    printf("Efficiency: %f %%\n", baudRate > 0 ? 100 * transferRate / baudRate : 0);
+    printf("Line: Tx -> Rx %llu bytes, %lu bit errors; Rx -> Tx %llu bytes, %lu bit errors\n",
+           peers[1].bytes, peers[1].bitErrors, peers[0].bytes, peers[0].bitErrors);
+
+    int failures = verifyFiles(&list, hashes, outDir);
+    if (failures == 0)
+        printf("Verified %d files in %s\n", list.count, outDir);
+    free(hashes);
+    freeFileList(&list);
+
+    return failures == 0 ? 0 : 1;
+}
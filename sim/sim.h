@@ -0,0 +1,49 @@
+// Simulated serial port and virtual clock header.
+// Included by the link layer when it is built with -DLL_SIM (see sim.c).
+// Must be included after the system headers, since it renames their calls.
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <termios.h>
+#include <time.h>
+
+// Tx and Rx run as threads of the same process, each with its own state.
+#define LL_LOCAL _Thread_local
+
+// Serial port, as seen by the calling thread's end of the simulated line.
+int sim_open(const char *path, int flags);
+int sim_close(int fd);
+ssize_t sim_read(int fd, void *buf, size_t count);
+ssize_t sim_write(int fd, const void *buf, size_t count);
+int sim_tcgetattr(int fd, struct termios *termios);
+int sim_tcsetattr(int fd, int actions, const struct termios *termios);
+int sim_tcflush(int fd, int queue);
+
+// Alarms, sleeps and time of the calling thread, on the virtual clock.
+unsigned int sim_alarm(unsigned int seconds);
+int sim_setitimer(int which, const struct itimerval *value, struct itimerval *old);
+void (*sim_signal(int signum, void (*handler)(int)))(int);
+int sim_sigaction(int signum, const struct sigaction *action, struct sigaction *old);
+int sim_nanosleep(const struct timespec *request, struct timespec *remaining);
+int sim_gettimeofday(struct timeval *tv, void *tz);
+
+#define open sim_open
+#define close sim_close
+#define read sim_read
+#define write sim_write
+#define tcgetattr sim_tcgetattr
+#define tcsetattr sim_tcsetattr
+#define tcflush sim_tcflush
+#define alarm sim_alarm
+#define setitimer sim_setitimer
+#define signal sim_signal
+// Function-like, so that "struct sigaction" keeps its name
+#define sigaction(signum, action, old) sim_sigaction(signum, action, old)
+#define nanosleep sim_nanosleep
+#define gettimeofday sim_gettimeofday
+
+#endif // _SIM_H_
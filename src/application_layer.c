@@ -1,79 +1,1099 @@
 // Application layer protocol implementation
 
+#define _FILE_OFFSET_BITS 64
+
 #include "application_layer.h"
+#include "chunk_store.h"
+#include "compression.h"
+#include "control.h"
+#include "delta.h"
+#include "file_hash.h"
+#include "file_list.h"
+#include "file_reader.h"
+#include "file_writer.h"
 #include "link_layer.h"
+#include "link_layer_ext.h"
+#include "packet.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Turns a received name into the path the file is written to
+void receivedName(unsigned char* name){
+    char path[MAX_PAYLOAD_SIZE];
+    const char *component = (const char *)name;
+    int pathsize = 0;
+    int components = 0;
+
+    // Never outside the current directory: no leading slashes, "." or ".."
+    while (*component != '\0') {
+        const char *next = strchr(component, '/');
+        if (next == NULL)
+            next = component + strlen(component);
+        int size = next - component;
 
-//Creates a control packet
-int buildControlPacket(int controlfield, const char* filename, int length){
-    int lensize = 0;
-    int tmp = length;
+        if (size > 0 && strncmp(component, ".", size) != 0 && strncmp(component, "..", size) != 0) {
+            if (pathsize > 0)
+                path[pathsize++] = '/';
+            memcpy(path + pathsize, component, size);
+            pathsize += size;
 
-    while (tmp > 0) {
-        tmp >>= 8;
-        lensize++;
+            // A directory sent as a whole is received as "directory-received"
+            if (components++ == 0 && *next == '/') {
+                memcpy(path + pathsize, "-received", 9);
+                pathsize += 9;
+            }
+        }
+        component = *next == '/' ? next + 1 : next;
     }
+    path[pathsize] = '\0';
+    memcpy(name, path, pathsize + 1);
 
-    int namesize = strlen(filename);
-    int size = 5+lensize+namesize;
-    unsigned char control[size];
-    int i = 0;
+    if (components > 1)
+        return;
 
-    control[i++] = controlfield;
-    control[i++] = 0;
-    control[i] = lensize;
-    for (int j = i + lensize; j > i; j--){
-        control[j] = length & 0xFF;
-        length >>= 8;
+    int namesize = pathsize;
+    int format_pos = -1;
+    for (int i = 0; i < namesize; i++) {
+        if (name[i] == '.' && (i + 3) < namesize && name[i + 1] == 'g' && name[i + 2] == 'i' && name[i + 3] == 'f') {
+            format_pos = i;
+            break;
+        }
     }
-    i+=lensize+1;
-    control[i++] = 1;
-    control[i++] = namesize;
 
-    memcpy(control+i,filename,namesize);
-    return llwrite(control, size);
+    if (format_pos != -1) {
+        memmove(name + format_pos, "-received.gif", 14);
+    }
 }
 
-//Reads a control packet
-int readControlPacket(unsigned char* name){
-    unsigned char control[MAX_PAYLOAD_SIZE];
+//Creates the directories a path goes through
+int makeParents(const char* path){
+    char parent[MAX_PAYLOAD_SIZE];
+
+    for (int i = 0; path[i] != '\0'; i++){
+        if (path[i] == '/'){
+            memcpy(parent, path, i);
+            parent[i] = '\0';
+            if (mkdir(parent, 0755) == -1 && errno != EEXIST)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+//Sends the signatures of the basis, in as many packets as needed
+int buildSignaturePackets(const Basis* basis){
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int sent = 0;
+    int count;
+
+    // A full packet is always followed by another one, empty if need be
+    do {
+        count = basis->count - sent < SIGNATURES_PER_PACKET ? basis->count - sent : SIGNATURES_PER_PACKET;
+        packet[0] = PACKET_SIGNATURES;
+        packet[1] = (SIGNATURE_SIZE*count) >> 8 & 0xFF;
+        packet[2] = (SIGNATURE_SIZE*count) & 0xFF;
+        for (int n = 0; n < count; n++){
+            putValue(packet+3+SIGNATURE_SIZE*n, basis->signatures[sent+n].weak, 4);
+            putValue(packet+3+SIGNATURE_SIZE*n+4, basis->signatures[sent+n].strong, 8);
+        }
+        if (llwrite(packet, 3+SIGNATURE_SIZE*count) == -1)
+            return -1;
+        sent += count;
+    } while (count == SIGNATURES_PER_PACKET);
+    return 0;
+}
+
+//Reads the signatures of the basis the receiver has
+int readSignaturePackets(Basis* basis){
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int capacity = basis->size / basis->blockSize;
     int reada;
-    while ((reada = llread(control)) == -1);
-    if (reada == -2){
-        return -2;
+    int count;
+
+    basis->count = 0;
+    basis->signatures = malloc((capacity + 1) * sizeof(BlockSignature));
+    if (basis->signatures == NULL)
+        return -1;
+    do {
+        while ((reada = llread(packet)) == -1);
+        if (reada < 3 || packet[0] != PACKET_SIGNATURES)
+            return -1;
+        count = (packet[1] << 8 | packet[2]) / SIGNATURE_SIZE;
+        if (reada < 3+SIGNATURE_SIZE*count || basis->count + count > capacity)
+            return -1;
+        for (int n = 0; n < count; n++){
+            basis->signatures[basis->count].weak = getValue(packet+3+SIGNATURE_SIZE*n, 4);
+            basis->signatures[basis->count].strong = getValue(packet+3+SIGNATURE_SIZE*n+4, 8);
+            basis->count++;
+        }
+    } while (count == SIGNATURES_PER_PACKET);
+    return 0;
+}
+
+//Writes and verifies data, in pieces that end where blocks of the file do
+//as verification wants
+int writeVerified(FileWriter* writer, Verifier* verifier, off_t offset, const unsigned char* data, off_t size){
+    while (size > 0){
+        off_t piece = HASH_BLOCK_SIZE - offset % HASH_BLOCK_SIZE;
+        if (piece > size)
+            piece = size;
+        verifyData(verifier, offset, data, piece);
+        if (writeData(writer, offset, data, piece) == -1)
+            return -1;
+        offset += piece;
+        data += piece;
+        size -= piece;
     }
+    return 0;
+}
+
+//Copies size bytes of the basis at basisOffset to offset in the file
+int copyFromBasis(const Basis* basis, off_t offset, off_t basisOffset, off_t size, FileWriter* writer, Verifier* verifier){
+    unsigned char block[HASH_BLOCK_SIZE];
 
-    int size = 0;
-    int filesize = control[2];
-    int i;
-    for (i = 3; i < 3+filesize; i++){
-        size += control[i];
-        if (i+1 < 3+filesize){
-            size <<= 8;
+    while (size > 0){
+        off_t piece = HASH_BLOCK_SIZE - offset % HASH_BLOCK_SIZE;
+        if (piece > size)
+            piece = size;
+        if (pread(basis->fd, block, piece, basisOffset) != piece)
+            return -1;
+        if (writeVerified(writer, verifier, offset, block, piece) == -1)
+            return -1;
+        offset += piece;
+        basisOffset += piece;
+        size -= piece;
+    }
+    return 0;
+}
+
+//Chunks of the last query of the transmitter, and the one being received
+typedef struct {
+    ChunkStore store;
+    Chunk chunks[CHUNKS_PER_QUERY];
+    int count;
+    int current; // Chunk being collected to be stored, -1 if none
+    int filled;
+    unsigned char data[CHUNK_MAX_SIZE];
+} ChunkReceiver;
+
+//Answers a query of the transmitter with the chunks the store has
+int answerChunkQuery(ChunkReceiver* receiver, const unsigned char* query, int size){
+    unsigned char answer[3+(CHUNKS_PER_QUERY+7)/8] = {0};
+    int count = ((query[1] << 8 | query[2]) - 8) / CHUNK_ENTRY_SIZE;
+
+    if (size < 11 || count < 0 || count > CHUNKS_PER_QUERY || size < 11+CHUNK_ENTRY_SIZE*count)
+        return 0;
+    off_t offset = getValue(query+3, 8);
+    for (int n = 0; n < count; n++){
+        Chunk* chunk = &receiver->chunks[n];
+        chunk->offset = offset;
+        chunk->hash = getValue(query+11+CHUNK_ENTRY_SIZE*n, 8);
+        chunk->size = getValue(query+19+CHUNK_ENTRY_SIZE*n, 4);
+        chunk->stored = chunk->size <= CHUNK_MAX_SIZE && hasChunk(&receiver->store, chunk->hash, chunk->size);
+        if (chunk->stored)
+            answer[3+n/8] |= 1 << (n%8);
+        offset += chunk->size;
+    }
+    receiver->count = count;
+    receiver->current = -1;
+
+    answer[0] = PACKET_HAVE;
+    answer[1] = 0;
+    answer[2] = (count+7)/8;
+    return llwrite(answer, 3+(count+7)/8) == -1 ? -1 : 0;
+}
+
+//Writes a chunk of the store the transmitter refers to
+int receiveChunkReference(ChunkReceiver* receiver, const unsigned char* reference, FileWriter* writer, Verifier* verifier, off_t len){
+    off_t offset = getValue(reference+3, 8);
+    uint64_t hash = getValue(reference+11, 8);
+    int size = getValue(reference+19, 4);
+
+    // A chunk lost from the store is asked again by verification
+    if (offset < 0 || size > CHUNK_MAX_SIZE || size > len - offset
+        || loadChunk(&receiver->store, hash, size, receiver->data) == -1)
+        return 0;
+    return writeVerified(writer, verifier, offset, receiver->data, size);
+}
+
+//Collects the data of a chunk the store did not have, and stores it once complete
+void collectChunkData(ChunkReceiver* receiver, off_t offset, const unsigned char* data, int size){
+    for (int n = 0; n < receiver->count; n++){
+        Chunk* chunk = &receiver->chunks[n];
+        if (offset < chunk->offset || offset >= chunk->offset + chunk->size)
+            continue;
+        if (chunk->stored)
+            return;
+        if (offset == chunk->offset){
+            receiver->current = n;
+            receiver->filled = 0;
+        }
+        if (receiver->current != n || offset != chunk->offset + receiver->filled || receiver->filled + size > chunk->size)
+            return;
+
+        memcpy(receiver->data + receiver->filled, data, size);
+        receiver->filled += size;
+        if (receiver->filled == chunk->size){
+            // Only what hashes right is kept
+            if (xxh64(receiver->data, chunk->size, 0) == chunk->hash)
+                saveChunk(&receiver->store, chunk->hash, receiver->data, chunk->size);
+            chunk->stored = TRUE;
+            receiver->current = -1;
         }
+        return;
     }
+}
 
-    int namesize = control[++i];
-    memcpy(name,control+(++i), namesize);
-    name[namesize]='\0';
+//Sends the items of a VERIFY list, in as many packets as needed
+int buildVerifyPackets(const VerifyList* list){
+    unsigned char verify[MAX_PAYLOAD_SIZE];
+    int sent = 0;
+    int count;
 
-    int format_pos = -1;
-    for (int i = 0; i < namesize; i++) {
-        if (name[i] == '.' && (i + 3) < namesize && name[i + 1] == 'g' && name[i + 2] == 'i' && name[i + 3] == 'f') {
-            format_pos = i;
+    // A full packet is always followed by another one, empty if need be
+    do {
+        count = list->count - sent < ITEMS_PER_PACKET ? list->count - sent : ITEMS_PER_PACKET;
+        verify[0] = PACKET_VERIFY;
+        verify[1] = (8*count) >> 8 & 0xFF;
+        verify[2] = (8*count) & 0xFF;
+        for (int n = 0; n < count; n++){
+            uint64_t item = list->items[sent+n];
+            for (int i = 3+8*n+7; i >= 3+8*n; i--){
+                verify[i] = item & 0xFF;
+                item >>= 8;
+            }
+        }
+        if (llwrite(verify, 3+8*count) == -1)
+            return -1;
+        sent += count;
+    } while (count == ITEMS_PER_PACKET);
+    return 0;
+}
+
+//Reads the items of a VERIFY list
+int readVerifyPackets(VerifyList* list){
+    unsigned char verify[MAX_PAYLOAD_SIZE];
+    int reada;
+    int count;
+
+    do {
+        while ((reada = llread(verify)) == -1);
+        if (reada < 3 || verify[0] != PACKET_VERIFY)
+            return -1;
+        count = (verify[1] << 8 | verify[2]) / 8;
+        if (reada < 3+8*count)
+            return -1;
+        for (int n = 0; n < count; n++){
+            uint64_t item = 0;
+            for (int i = 3+8*n; i < 3+8*n+8; i++)
+                item = (item << 8) | verify[i];
+            if (addVerifyItem(list, item) == -1)
+                return -1;
+        }
+    } while (count == ITEMS_PER_PACKET);
+    return 0;
+}
+
+//Hashes what the receiver already has of a file, to check it with the rest
+int verifyPrefix(Verifier* verifier, const char* name, off_t prefix){
+    unsigned char block[HASH_BLOCK_SIZE];
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+    for (off_t offset = 0; offset < prefix; offset += HASH_BLOCK_SIZE){
+        size_t size = prefix - offset < HASH_BLOCK_SIZE ? prefix - offset : HASH_BLOCK_SIZE;
+        if (pread(fd, block, size, offset) != (ssize_t)size){
+            close(fd);
+            return -1;
+        }
+        verifyData(verifier, offset, block, size);
+    }
+    close(fd);
+    return 0;
+}
+
+//Packed blocks being received, and the pool of threads that unpacks them
+typedef struct {
+    BlockPool pool;
+    CompressJob* assembling; // Block whose pieces are arriving, NULL if none
+    int assembled;           // Bytes of it received so far
+} Unpacker;
+
+//Writes the blocks unpacked so far, or all of them if wait is set
+int writeUnpacked(Unpacker* unpacker, int wait, FileWriter* writer, Verifier* verifier, off_t len){
+    CompressJob* job;
+
+    while ((job = finishedJob(&unpacker->pool, wait)) != NULL){
+        // A block that does not unpack is asked again by verification
+        int result = 0;
+        if (job->rawSize > 0 && job->offset + job->rawSize <= len){
+            verifyData(verifier, job->offset, job->raw, job->rawSize);
+            result = writeData(writer, job->offset, job->raw, job->rawSize);
+        }
+        releaseJob(&unpacker->pool);
+        if (result == -1)
+            return -1;
+    }
+    return 0;
+}
+
+//Adds a piece of a packed block, handing the block to the pool once complete
+int receivePacked(Unpacker* unpacker, const unsigned char* data, int size, FileWriter* writer, Verifier* verifier, off_t len){
+    off_t offset = 0;
+    for (int i = 3; i < DATA_HEADER_SIZE; i++)
+        offset = (offset << 8) | data[i];
+    int position = data[11] << 16 | data[12] << 8 | data[13];
+    data += PACKED_DATA_HEADER_SIZE;
+    size -= PACKED_DATA_HEADER_SIZE;
+
+    // A block starts with its first piece, in a job the pool is done with
+    if (position == 0){
+        while ((unpacker->assembling = freeJob(&unpacker->pool)) == NULL){
+            if (writeUnpacked(unpacker, TRUE, writer, verifier, len) == -1)
+                return -1;
+        }
+        unpacker->assembling->offset = offset;
+        unpacker->assembled = 0;
+    }
+
+    // Pieces out of place were damaged on the way: the block is dropped
+    CompressJob* job = unpacker->assembling;
+    if (job == NULL || job->offset != offset || position != unpacker->assembled || position + size > PACKED_BLOCK_MAX){
+        unpacker->assembling = NULL;
+        return 0;
+    }
+    memcpy(job->packed + position, data, size);
+    unpacker->assembled += size;
+
+    int packedSize = packedBlockSize(job->packed, unpacker->assembled);
+    if (packedSize == unpacker->assembled){
+        job->packedSize = packedSize;
+        submitJob(&unpacker->pool);
+        unpacker->assembling = NULL;
+    }
+    else if (packedSize != -1 && packedSize < unpacker->assembled){
+        unpacker->assembling = NULL;
+    }
+    return writeUnpacked(unpacker, FALSE, writer, verifier, len);
+}
+
+//Receives the file offered by a start packet.
+//Returns 0 once verified, 1 if a small file did not verify, -1 on errors
+int receiveFile(const FileSettings* offer){
+    unsigned char name[MAX_PAYLOAD_SIZE];
+    off_t len = offer->size;
+
+    strcpy((char *)name, offer->name);
+    receivedName(name);
+    if (makeParents((const char *)name) == -1){
+        perror("Error creating the file\n");
+        return -1;
+    }
+
+    // Small files are not worth a turnaround of the link: they start over
+    int resumable = len >= RESUME_MIN_SIZE;
+
+    // A complete copy from an earlier transfer, one without a checkpoint,
+    // is the basis of a delta. The new file replaces it once verified.
+    Basis basis = {.fd = -1};
+    char path[MAX_PAYLOAD_SIZE + 16];
+    int delta = FALSE;
+    snprintf(path, sizeof(path), "%s%s", name, CHECKPOINT_SUFFIX);
+    if (resumable && offer->delta && access(path, F_OK) == -1 && openBasis(&basis, (const char *)name) == 0)
+        delta = TRUE;
+    snprintf(path, sizeof(path), "%s%s", name, delta ? DELTA_SUFFIX : "");
+
+    FileWriter writer;
+    off_t resume = 0;
+    if (openFileWriter(&writer, path, len, resumable && !delta ? &resume : NULL) == -1){
+        perror("Error creating the file\n");
+        if (delta)
+            closeBasis(&basis);
+        return -1;
+    }
+
+    // What is already there is verified as well, from the start of its block
+    Verifier verifier;
+    startVerifier(&verifier, len);
+    resume -= resume % HASH_BLOCK_SIZE;
+    if (resume > 0 && verifyPrefix(&verifier, (const char *)name, resume) == -1)
+        resume = 0;
+    if (resume > 0)
+        printf("Resuming %s at byte %lld\n", name, (long long)resume);
+
+    // Chunks are accepted along with the resume offset when there is a store,
+    // else compression, unless a delta is
+    ChunkReceiver* chunks = NULL;
+    if (resumable && !delta && offer->chunks && (chunks = malloc(sizeof(ChunkReceiver))) != NULL){
+        chunks->count = 0;
+        if (openChunkStore(&chunks->store) == -1){
+            free(chunks);
+            chunks = NULL;
+        }
+    }
+    Unpacker unpacker = {0};
+    int compression = COMPRESS_NONE;
+    if (resumable && !delta && chunks == NULL && (offer->compression & 1 << COMPRESS_LZ) && startBlockPool(&unpacker.pool, -1) == 0)
+        compression = COMPRESS_LZ;
+
+    // The receiver answers with the settings it accepts
+    AcceptedSettings accepted = {
+        .offset = resume,
+        .compression = compression,
+        .basisBlockSize = delta ? basis.blockSize : 0,
+        .basisSize = basis.size,
+        .basisRoot = basis.root,
+        .chunks = chunks != NULL,
+    };
+    int result = 0;
+    if (resumable && buildResumePacket(&accepted) == -1){
+        perror("Error transfering the control\n");
+        result = -1;
+    }
+
+    int read;
+    int verified = FALSE;
+    int unchanged = FALSE;
+    off_t received = 0;
+    unsigned char data[MAX_PAYLOAD_SIZE];   
+    while (result == 0) {
+        while ((read = llread(data)) == -1);
+        if (read == -2){
+            perror("Error transfering the data\n");
+            result = -1;
             break;
         }
+        if (data[0] == PACKET_END){
+            FileSettings end;
+            int bad = -1;
+            if (compression != COMPRESS_NONE && writeUnpacked(&unpacker, TRUE, &writer, &verifier, len) == -1){
+                perror("Error writing the file\n");
+                result = -1;
+                break;
+            }
+            if (parseControlPacket(data, read, &end) == 0 && end.hashed){
+                // An end packet alone tells that the basis is the file already
+                unchanged = delta && received == 0 && end.hash == basis.root && basis.size == len;
+                bad = unchanged ? 0 : verifyEnd(&verifier, end.hash);
+            }
+            verified = bad == 0;
+            if (!resumable)
+                break;
+
+            // Large files get the blocks that differ again, or all of them
+            VerifyList list = {0};
+            if (bad == -1){
+                addVerifyItem(&list, VERIFY_RESTART);
+                freeVerifier(&verifier);
+                startVerifier(&verifier, len);
+            }
+            for (int i = 0; i < bad; i++)
+                addVerifyItem(&list, verifier.bad.blocks[i].offset);
+            if (buildVerifyPackets(&list) == -1){
+                perror("Error transfering the control\n");
+                result = -1;
+            }
+            freeVerifyList(&list);
+            if (verified)
+                break;
+            continue;
+        }
+        if (data[0] == PACKET_HASHES && read >= DATA_HEADER_SIZE){
+            off_t offset = 0;
+            for (int i = 3; i < DATA_HEADER_SIZE; i++)
+                offset = (offset << 8) | data[i];
+            verifyHashes(&verifier, offset, data+DATA_HEADER_SIZE, (read-DATA_HEADER_SIZE)/8);
+            continue;
+        }
+        if (data[0] == PACKET_PACKED && compression != COMPRESS_NONE && read > PACKED_DATA_HEADER_SIZE){
+            received += read;
+            if (receivePacked(&unpacker, data, read, &writer, &verifier, len) == -1){
+                perror("Error writing the file\n");
+                result = -1;
+            }
+            continue;
+        }
+        if (data[0] == PACKET_SIGNATURES && delta){
+            if (buildSignaturePackets(&basis) == -1){
+                perror("Error transfering the control\n");
+                result = -1;
+            }
+            continue;
+        }
+        if (data[0] == PACKET_HAVE && chunks != NULL){
+            if (answerChunkQuery(chunks, data, read) == -1){
+                perror("Error transfering the control\n");
+                result = -1;
+            }
+            continue;
+        }
+        if (data[0] == PACKET_CHUNK && chunks != NULL && read >= CHUNK_REF_SIZE){
+            received += read;
+            if (receiveChunkReference(chunks, data, &writer, &verifier, len) == -1){
+                perror("Error writing the file\n");
+                result = -1;
+            }
+            continue;
+        }
+        if (data[0] == PACKET_COPY && delta && read >= COPY_PACKET_SIZE){
+            off_t offset = getValue(data+3, 8);
+            off_t basisOffset = getValue(data+11, 8);
+            off_t size = getValue(data+19, 8);
+            received += size;
+            if (offset < 0 || size < 0 || size > len - offset || basisOffset < 0 || size > basis.size - basisOffset)
+                continue;
+            if (copyFromBasis(&basis, offset, basisOffset, size, &writer, &verifier) == -1){
+                perror("Error writing the file\n");
+                result = -1;
+            }
+            continue;
+        }
+        if (data[0] != PACKET_DATA || read < DATA_HEADER_SIZE)
+            continue;
+
+        // Data out of the file was damaged on the way, verification gets it again
+        off_t offset = 0;
+        for (int i = 3; i < DATA_HEADER_SIZE; i++)
+            offset = (offset << 8) | data[i];
+        received += read;
+        if (offset < 0 || offset + read - DATA_HEADER_SIZE > len)
+            continue;
+        verifyData(&verifier, offset, data+DATA_HEADER_SIZE, read-DATA_HEADER_SIZE);
+        if (writeData(&writer, offset, data+DATA_HEADER_SIZE, read-DATA_HEADER_SIZE) == -1){
+            perror("Error writing the file\n");
+            result = -1;
+        }
+        if (chunks != NULL)
+            collectChunkData(chunks, offset, data+DATA_HEADER_SIZE, read-DATA_HEADER_SIZE);
     }
 
-    if (format_pos != -1) {
-        memmove(name + format_pos, "-received.gif", 14);
+    if (compression != COMPRESS_NONE)
+        stopBlockPool(&unpacker.pool);
+    free(chunks);
+    freeVerifier(&verifier);
+    if (closeFileWriter(&writer, verified && !unchanged && result == 0) == -1 && result == 0){
+        perror("Error writing the file\n");
+        result = -1;
+    }
+
+    // The delta replaces its basis only once verified
+    if (delta){
+        closeBasis(&basis);
+        if (verified && !unchanged && result == 0 && rename(path, (const char *)name) == -1){
+            perror("Error writing the file\n");
+            result = -1;
+        }
+        if (!verified || unchanged || result == -1)
+            unlink(path);
+    }
+    if (unchanged)
+        printf("%s is unchanged\n", name);
+    if (result == -1)
+        return -1;
+
+    // The file keeps the modification time of the original
+    if (verified && offer->timed){
+        struct timespec times[2] = {{0, UTIME_OMIT}, {offer->mtime, offer->mtimeNsec}};
+        if (utimensat(AT_FDCWD, (const char *)name, times, 0) == -1)
+            perror((const char *)name);
+    }
+    if (!verified)
+        printf("%s failed verification%s\n", name, resumable ? ", the next transfer resumes it" : "");
+    return verified ? 0 : 1;
+}
+
+//Block hashes of the file being sent, and the HASHES packet they go out in
+typedef struct {
+    BlockHasher hasher;
+    Xxh64State root;
+    int announce; // Only large files send HASHES packets
+    int count;
+    off_t first;
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+} SentHashes;
+
+void startSentHashes(SentHashes* hashes, off_t len, int announce){
+    startBlockHasher(&hashes->hasher, len);
+    xxh64Reset(&hashes->root, 0);
+    hashes->announce = announce;
+    hashes->count = 0;
+}
+
+//Sends the block hashes not sent yet in a HASHES packet
+int flushHashes(SentHashes* hashes){
+    if (hashes->count == 0)
+        return 0;
+
+    off_t first = hashes->first;
+    hashes->packet[0] = PACKET_HASHES;
+    hashes->packet[1] = (8*hashes->count) >> 8 & 0xFF;
+    hashes->packet[2] = (8*hashes->count) & 0xFF;
+    for (int i = 10; i > 2; i--){
+        hashes->packet[i] = first & 0xFF;
+        first >>= 8;
+    }
+    int size = DATA_HEADER_SIZE+8*hashes->count;
+    hashes->count = 0;
+    return llwrite(hashes->packet, size) == -1 ? -1 : 0;
+}
+
+//Hashes data of the file, announcing each block it completes
+int hashSentData(SentHashes* hashes, off_t offset, const unsigned char* data, size_t size){
+    BlockHash block;
+
+    if (!hashBlockData(&hashes->hasher, offset, data, size, &block))
+        return 0;
+    rootUpdate(&hashes->root, block.hash);
+    if (!hashes->announce)
+        return 0;
+
+    if (hashes->count == 0)
+        hashes->first = block.offset;
+    uint64_t hash = block.hash;
+    for (int i = DATA_HEADER_SIZE+8*hashes->count+7; i >= DATA_HEADER_SIZE+8*hashes->count; i--){
+        hashes->packet[i] = hash & 0xFF;
+        hash >>= 8;
+    }
+    hashes->count++;
+    return hashes->count == HASHES_PER_PACKET ? flushHashes(hashes) : 0;
+}
+
+//Sends the bytes [from, to) of a file in data packets, hashing them unless hashes is NULL
+int sendRange(int fd, off_t from, off_t to, SentHashes* hashes){
+    unsigned char header[DATA_HEADER_SIZE];
+    unsigned char data[MAX_DATA_SIZE];
+
+    for (off_t offset = from; offset < to; ){
+        int datasize = to - offset < MAX_DATA_SIZE ? to - offset : MAX_DATA_SIZE;
+        if (pread(fd, data, datasize, offset) != datasize)
+            return -1;
+
+        header[0] = PACKET_DATA;
+        header[1] = datasize >> 8 & 0xFF;
+        header[2] = datasize & 0xFF;
+        off_t value = offset;
+        for (int i = 10; i > 2; i--){
+            header[i] = value & 0xFF;
+            value >>= 8;
+        }
+        if (hashes != NULL && hashSentData(hashes, offset, data, datasize) == -1)
+            return -1;
+        struct iovec iov[2] = {
+            {header, DATA_HEADER_SIZE},
+            {data, datasize},
+        };
+        if (llwritev(iov, 2) == -1)
+            return -1;
+        offset += datasize;
     }
     return 0;
 }
 
+//Sends a packed block in pieces, hashing the data it holds
+int sendPackedBlock(const CompressJob* job, SentHashes* hashes){
+    unsigned char header[PACKED_DATA_HEADER_SIZE];
+
+    if (hashSentData(hashes, job->offset, job->raw, job->rawSize) == -1)
+        return -1;
+    for (int position = 0; position < job->packedSize; ){
+        int size = job->packedSize - position < MAX_PAYLOAD_SIZE - PACKED_DATA_HEADER_SIZE
+                       ? job->packedSize - position : MAX_PAYLOAD_SIZE - PACKED_DATA_HEADER_SIZE;
+        header[0] = PACKET_PACKED;
+        header[1] = size >> 8 & 0xFF;
+        header[2] = size & 0xFF;
+        off_t value = job->offset;
+        for (int i = 10; i > 2; i--){
+            header[i] = value & 0xFF;
+            value >>= 8;
+        }
+        header[11] = position >> 16 & 0xFF;
+        header[12] = position >> 8 & 0xFF;
+        header[13] = position & 0xFF;
+        struct iovec iov[2] = {
+            {header, PACKED_DATA_HEADER_SIZE},
+            {job->packed + position, size},
+        };
+        if (llwritev(iov, 2) == -1)
+            return -1;
+        position += size;
+    }
+    return 0;
+}
+
+//Sends the bytes [from, to) of a file in packed blocks, which a pool of
+//threads reads and compresses ahead of the link
+int sendPacked(int fd, off_t from, off_t to, SentHashes* hashes){
+    BlockPool pool;
+    CompressJob* job;
+    off_t next = from;
+    int result = 0;
+
+    if (startBlockPool(&pool, fd) == -1)
+        return -1;
+    while (result == 0){
+        while (next < to && (job = freeJob(&pool)) != NULL){
+            job->offset = next;
+            job->rawSize = to - next < COMPRESS_BLOCK_SIZE ? to - next : COMPRESS_BLOCK_SIZE;
+            submitJob(&pool);
+            next += job->rawSize;
+        }
+        if ((job = finishedJob(&pool, TRUE)) == NULL)
+            break;
+        result = job->packedSize == -1 ? -1 : sendPackedBlock(job, hashes);
+        releaseJob(&pool);
+    }
+    stopBlockPool(&pool);
+    return result;
+}
+
+//Hashes the bytes [from, to) of a file without sending them
+int hashRange(int fd, off_t from, off_t to, SentHashes* hashes){
+    unsigned char block[HASH_BLOCK_SIZE];
+
+    for (off_t offset = from; offset < to; offset += HASH_BLOCK_SIZE){
+        size_t size = to - offset < HASH_BLOCK_SIZE ? to - offset : HASH_BLOCK_SIZE;
+        if (pread(fd, block, size, offset) != (ssize_t)size)
+            return -1;
+        if (hashSentData(hashes, offset, block, size) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+//The file a delta is sent from, and the hashes of what it makes
+typedef struct {
+    const FileReader* reader;
+    SentHashes* hashes;
+} DeltaSender;
+
+//Sends literal data of a delta
+int sendLiteral(void* context, off_t offset, off_t size){
+    DeltaSender* sender = context;
+    return sendRange(sender->reader->fd, offset, offset + size, sender->hashes);
+}
+
+//Hashes data of a mapped file the receiver makes on its own, in pieces that
+//end where blocks do as hashing wants
+int hashMapped(SentHashes* hashes, const FileReader* reader, off_t offset, off_t size){
+    for (off_t done = 0; done < size; ){
+        off_t piece = HASH_BLOCK_SIZE - (offset + done) % HASH_BLOCK_SIZE;
+        if (piece > size - done)
+            piece = size - done;
+        if (hashSentData(hashes, offset + done, reader->map + offset + done, piece) == -1)
+            return -1;
+        done += piece;
+    }
+    return 0;
+}
+
+//Sends a copy of the basis in a COPY packet
+int sendCopy(void* context, off_t offset, off_t basisOffset, off_t size){
+    DeltaSender* sender = context;
+    unsigned char copy[COPY_PACKET_SIZE];
+
+    if (hashMapped(sender->hashes, sender->reader, offset, size) == -1)
+        return -1;
+
+    copy[0] = PACKET_COPY;
+    copy[1] = 0;
+    copy[2] = COPY_PACKET_SIZE - 3;
+    putValue(copy+3, offset, 8);
+    putValue(copy+11, basisOffset, 8);
+    putValue(copy+19, size, 8);
+    return llwrite(copy, COPY_PACKET_SIZE) == -1 ? -1 : 0;
+}
+
+//Sends a mapped file as a delta against the basis of the receiver, or
+//nothing but the end packet if the basis is the same file
+int sendDelta(const FileReader* reader, Basis* remote, SentHashes* hashes, int* unchanged){
+    off_t len = reader->fileSize;
+
+    // A single hash of the whole file tells whether it changed
+    *unchanged = FALSE;
+    if (remote->size == len){
+        SentHashes own;
+        startSentHashes(&own, len, FALSE);
+        if (hashRange(reader->fd, 0, len, &own) == -1)
+            return -1;
+        if (xxh64Digest(&own.root) == remote->root){
+            hashes->root = own.root;
+            *unchanged = TRUE;
+            return 0;
+        }
+    }
+
+    unsigned char request = PACKET_SIGNATURES;
+    if (llwrite(&request, 1) == -1 || readSignaturePackets(remote) == -1)
+        return -1;
+
+    DeltaSender sender = {reader, hashes};
+    DeltaOutput output = {sendLiteral, sendCopy, &sender};
+    return computeDelta(reader->map, len, remote->signatures, remote->count, remote->blockSize, &output);
+}
+
+//Sends the bytes [from, to) of a mapped file in chunks, asking first which
+//ones the receiver has in its store. Counts the chunks in total and reused.
+int sendChunked(const FileReader* reader, off_t from, SentHashes* hashes, int* total, int* reused){
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    Chunk chunks[CHUNKS_PER_QUERY];
+    off_t len = reader->fileSize;
+    off_t offset = from;
+
+    while (offset < len){
+        // A query for the chunks that follow
+        int count = 0;
+        packet[0] = PACKET_HAVE;
+        putValue(packet+3, offset, 8);
+        while (count < CHUNKS_PER_QUERY && offset < len){
+            chunks[count].offset = offset;
+            chunks[count].size = nextChunk(reader->map + offset, len - offset);
+            chunks[count].hash = xxh64(reader->map + offset, chunks[count].size, 0);
+            putValue(packet+11+CHUNK_ENTRY_SIZE*count, chunks[count].hash, 8);
+            putValue(packet+19+CHUNK_ENTRY_SIZE*count, chunks[count].size, 4);
+            offset += chunks[count].size;
+            count++;
+        }
+        packet[1] = (8+CHUNK_ENTRY_SIZE*count) >> 8 & 0xFF;
+        packet[2] = (8+CHUNK_ENTRY_SIZE*count) & 0xFF;
+        if (llwrite(packet, 11+CHUNK_ENTRY_SIZE*count) == -1)
+            return -1;
+
+        int reada;
+        while ((reada = llread(packet)) == -1);
+        if (reada < 3+(count+7)/8 || packet[0] != PACKET_HAVE)
+            return -1;
+
+        // Then the chunks, by reference or in data packets
+        for (int n = 0; n < count; n++){
+            Chunk* chunk = &chunks[n];
+            if (packet[3+n/8] & 1 << (n%8)){
+                unsigned char reference[CHUNK_REF_SIZE];
+                reference[0] = PACKET_CHUNK;
+                reference[1] = 0;
+                reference[2] = CHUNK_REF_SIZE - 3;
+                putValue(reference+3, chunk->offset, 8);
+                putValue(reference+11, chunk->hash, 8);
+                putValue(reference+19, chunk->size, 4);
+                if (hashMapped(hashes, reader, chunk->offset, chunk->size) == -1 || llwrite(reference, CHUNK_REF_SIZE) == -1)
+                    return -1;
+                (*reused)++;
+            }
+            else if (sendRange(reader->fd, chunk->offset, chunk->offset + chunk->size, hashes) == -1){
+                return -1;
+            }
+        }
+        *total += count;
+    }
+    return 0;
+}
+
+//Sends a file under the given name. Small files are checked at the end of
+//their round, large ones are verified and fixed before this returns.
+int sendFile(const char* path, const char* name, int* small){
+    FileReader reader;
+    SentHashes hashes;
+
+    if (strlen(name) > 255){
+        errno = ENAMETOOLONG;
+        perror(name);
+        return -1;
+    }
+    if (openFileReader(&reader, path) == -1) {
+        perror("This file wasn't found\n");
+        return -1;
+    }
+
+    off_t len = reader.fileSize;
+    int resumable = len >= RESUME_MIN_SIZE;
+    *small = !resumable;
+
+    // Compression needs the reply of the receiver, and blocks read at will,
+    // deltas and chunks need the whole file mapped to look into it
+    struct stat st;
+    int regular = fstat(reader.fd, &st) == 0 && S_ISREG(st.st_mode);
+    int offered = resumable && regular ? offeredCompression() : 0;
+    int offeredDelta = resumable && reader.map != NULL;
+
+    // Regular files keep their modification time on the other side
+    FileSettings offer = {.size = len, .compression = offered, .delta = offeredDelta, .chunks = offeredDelta};
+    strcpy(offer.name, name);
+    if (regular){
+        offer.timed = TRUE;
+        offer.mtime = st.st_mtim.tv_sec;
+        offer.mtimeNsec = st.st_mtim.tv_nsec;
+    }
+    if (buildControlPacket(PACKET_START, &offer) == -1){
+        perror("Control packet error\n");
+        closeFileReader(&reader);
+        return -1;
+    }
+
+    // The receiver tells how much of the file it already has
+    AcceptedSettings accepted = {0};
+    if (resumable && (readResumePacket(&accepted) == -1 || accepted.offset > len
+                      || (accepted.compression != COMPRESS_NONE && !(offered & 1 << accepted.compression))
+                      || (accepted.basisBlockSize > 0 && (!offeredDelta || accepted.offset > 0))
+                      || (accepted.chunks && !offeredDelta))){
+        perror("Control packet error\n");
+        closeFileReader(&reader);
+        return -1;
+    }
+    off_t resume = accepted.offset;
+    int compression = accepted.compression;
+    int chunked = accepted.chunks;
+    Basis remote = {.fd = -1, .blockSize = accepted.basisBlockSize, .size = accepted.basisSize, .root = accepted.basisRoot};
+    if (resume > 0)
+        printf("Resuming %s at byte %lld\n", name, (long long)resume);
+
+    // The hashes cover what the receiver already has as well
+    startSentHashes(&hashes, len, resumable);
+    if (hashRange(reader.fd, 0, resume, &hashes) == -1
+        || (compression == COMPRESS_NONE && remote.blockSize == 0 && !chunked && startFileReader(&reader, resume) == -1)){
+        perror("Error reading the file\n");
+        closeFileReader(&reader);
+        return -1;
+    }
+
+    if (remote.blockSize > 0){
+        int unchanged;
+        int result = sendDelta(&reader, &remote, &hashes, &unchanged);
+        closeBasis(&remote);
+        if (result == -1 || flushHashes(&hashes) == -1){
+            perror("Error transfering the data\n");
+            closeFileReader(&reader);
+            return -1;
+        }
+        if (unchanged)
+            printf("%s is unchanged\n", name);
+    }
+    else if (chunked){
+        int total = 0;
+        int reused = 0;
+        if (sendChunked(&reader, resume, &hashes, &total, &reused) == -1 || flushHashes(&hashes) == -1){
+            perror("Error transfering the data\n");
+            closeFileReader(&reader);
+            return -1;
+        }
+        if (reused > 0)
+            printf("%d of the %d chunks of %s were in the receiver's store\n", reused, total, name);
+    }
+    else if (compression != COMPRESS_NONE){
+        if (sendPacked(reader.fd, resume, len, &hashes) == -1 || flushHashes(&hashes) == -1){
+            perror("Error transfering the data\n");
+            closeFileReader(&reader);
+            return -1;
+        }
+    }
+    else {
+        const PacketBuffer *data_packet;
+        int written = 0;
+
+        while ((data_packet = nextPacket(&reader))->size > 0){
+            off_t offset = resume;
+            int datasize = data_packet->size - DATA_HEADER_SIZE;
+            struct iovec iov[2] = {
+                {(void *)data_packet->header, DATA_HEADER_SIZE},
+                {(void *)data_packet->data, datasize},
+            };
+            written = hashSentData(&hashes, offset, data_packet->data, datasize);
+            if (written != -1)
+                written = llwritev(iov, 2);
+            releasePacket(&reader);
+            resume += datasize;
+            if (written == -1)
+                break;
+        }
+
+        if (data_packet->size == -1 || written == -1 || flushHashes(&hashes) == -1){
+            // No end packet: the receiver keeps what it has for a resume
+            perror(data_packet->size == -1 ? "Error reading the file\n" : "Error transfering the data\n");
+            closeFileReader(&reader);
+            return -1;
+        }
+    }
+
+    FileSettings end = {.size = len, .hashed = TRUE, .hash = xxh64Digest(&hashes.root)};
+    strcpy(end.name, name);
+    for (int round = 0; ; round++){
+        if (buildControlPacket(PACKET_END, &end) == -1){
+            perror("Control packet error\n");
+            closeFileReader(&reader);
+            return -1;
+        }
+        if (!resumable)
+            break;
+
+        // The receiver lists the blocks it got wrong
+        VerifyList list = {0};
+        if (readVerifyPackets(&list) == -1){
+            perror("Control packet error\n");
+            freeVerifyList(&list);
+            closeFileReader(&reader);
+            return -1;
+        }
+        if (list.count == 0)
+            break;
+        if (round == MAX_VERIFY_ROUNDS){
+            fprintf(stderr, "%s failed verification\n", name);
+            freeVerifyList(&list);
+            closeFileReader(&reader);
+            return -1;
+        }
+
+        int result = 0;
+        if (list.items[0] == VERIFY_RESTART){
+            startSentHashes(&hashes, len, resumable);
+            if (compression != COMPRESS_NONE)
+                result = sendPacked(reader.fd, 0, len, &hashes);
+            else
+                result = sendRange(reader.fd, 0, len, &hashes);
+            if (result == 0)
+                result = flushHashes(&hashes);
+        }
+        else {
+            printf("Sending %d blocks of %s again\n", list.count, name);
+            for (int i = 0; i < list.count && result == 0; i++){
+                // Only the start of a block of the file can be asked for
+                if (list.items[i] >= (uint64_t)len || list.items[i] % HASH_BLOCK_SIZE != 0)
+                    continue;
+                off_t start = list.items[i];
+                off_t end = start + HASH_BLOCK_SIZE < len ? start + HASH_BLOCK_SIZE : len;
+                result = sendRange(reader.fd, start, end, NULL);
+            }
+        }
+        freeVerifyList(&list);
+        if (result == -1){
+            perror("Error transfering the data\n");
+            closeFileReader(&reader);
+            return -1;
+        }
+    }
+
+    closeFileReader(&reader);
+    return 0;
+}
+
+//Whether the transmitter calibrates the line, from the TX_CALIBRATE
+//environment variable: "off" (default) or "on"
+int calibrationWanted(){
+    const char *setting = getenv("TX_CALIBRATE");
+
+    if (setting == NULL || strcmp(setting, "off") == 0)
+        return 0;
+    if (strcmp(setting, "on") == 0)
+        return 1;
+
+    fprintf(stderr, "Unknown TX_CALIBRATE setting '%s', using 'off'\n", setting);
+    return 0;
+}
+
 void applicationLayer(const char *serialPort, const char *role, int baudRate, int nTries, int timeout, const char *filename) {
     LinkLayer parameters;    
     strcpy(parameters.serialPort, serialPort);
@@ -92,91 +1112,117 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
         perror("Connection failed\n");
         exit(EXIT_FAILURE);
     }
+    if (parameters.role == LlTx && calibrationWanted() && llcalibrate() == -1)
+        fprintf(stderr, "Line calibration failed, keeping the default frames\n");
     if (parameters.role == LlRx) {  
-        unsigned char name[MAX_PAYLOAD_SIZE];
-        if (readControlPacket(name) == -2){
-            perror("Error transfering the control\n");
-            llclose(statistics);
-            exit(EXIT_FAILURE);
-        }
-        FILE *fptr = fopen(name, "wb+");
-        int read;
-        unsigned char data[MAX_PAYLOAD_SIZE];   
-        do {
-            while ((read = llread(data)) == -1);
-            if (read == -2){
-                perror("Error transfering the data\n");
-                fclose(fptr);
+        unsigned char control[MAX_PAYLOAD_SIZE];
+        int reada;
+        VerifyList failed = {0};
+        int small = 0;
+
+        // Files follow each other until the transmitter disconnects
+        while (1) {
+            while ((reada = llread(control)) == -1);
+            if (reada == -2)
+                break;
+
+            // Small files that did not verify are asked again after their round
+            if (control[0] == PACKET_CHECK){
+                int result = buildVerifyPackets(&failed);
+                failed.count = 0;
+                small = 0;
+                if (result == -1){
+                    perror("Error transfering the control\n");
+                    freeVerifyList(&failed);
+                    llclose(statistics);
+                    exit(EXIT_FAILURE);
+                }
+                continue;
+            }
+            if (control[0] != PACKET_START)
+                continue;
+
+            FileSettings offer;
+            if (parseControlPacket(control, reada, &offer) == -1){
+                fprintf(stderr, "Malformed start packet\n");
+                continue;
+            }
+            int result = receiveFile(&offer);
+            if (result == -1){
+                freeVerifyList(&failed);
                 llclose(statistics);
                 exit(EXIT_FAILURE);
             }
-            if (data[0] == 3) break;
-            fwrite(data+3, 1, read-3, fptr);
-            fflush(fptr);
-        } while (1); 
-
-        fclose(fptr);
+            if (offer.size < RESUME_MIN_SIZE){
+                if (result == 1)
+                    addVerifyItem(&failed, small);
+                small++;
+            }
+        }
+        freeVerifyList(&failed);
         llclose(statistics);
     }
     else if (parameters.role == LlTx) {
-        FILE *fptr;
-        unsigned int start_ctrl = 2;
-        unsigned int end_ctrl = 3;
+        FileList list;
+        VerifyList round = {0};
+        VerifyList failed = {0};
+        int small;
 
-        fptr = fopen(filename, "rb");
-
-        if (fptr == NULL) {
+        if (buildFileList(filename, &list) == -1) {
             perror("This file wasn't found\n");
             exit(EXIT_FAILURE);
         }
 
-        fseek(fptr, 0, SEEK_END);
-        int len = ftell(fptr);
-        fseek(fptr, 0, SEEK_SET);
-
-        if (buildControlPacket(start_ctrl, filename, len) == -1){
-            perror("Control packet error\n");
-            fclose(fptr);
-            llclose(statistics);
-            exit(EXIT_FAILURE);
+        // One session for all the files, back to back
+        for (int i = 0; i < list.count; i++) {
+            if (sendFile(list.paths[i], list.names[i], &small) == -1) {
+                freeFileList(&list);
+                llclose(statistics);
+                exit(EXIT_FAILURE);
+            }
+            if (small)
+                addVerifyItem(&round, i);
         }
 
-        int bytesleft = len;
-        int datasize;
-        unsigned char data[MAX_PAYLOAD_SIZE-3];
-        unsigned char data_packet[MAX_PAYLOAD_SIZE];
-
-        while (bytesleft > 0){
-            data_packet[0] = 1;
-            if (bytesleft > MAX_PAYLOAD_SIZE-3){
-                datasize = MAX_PAYLOAD_SIZE-3;
-                bytesleft -= datasize;
-            }
-            else{
-                datasize = bytesleft;
-                bytesleft -= datasize;
+        // Then the small files that failed verification, by round
+        for (int r = 0; round.count > 0; r++) {
+            unsigned char check = PACKET_CHECK;
+            failed.count = 0;
+            if (llwrite(&check, 1) == -1 || readVerifyPackets(&failed) == -1) {
+                perror("Control packet error\n");
+                failed.count = -1;
+                break;
             }
-
-            fread(data, 1, datasize, fptr);
-            data_packet[1] = datasize >> 8 & 0xFF;
-            data_packet[2] = datasize & 0xFF;
-            memcpy(data_packet + 3, data, datasize);
-            int written = llwrite(data_packet, datasize+3);
-            if (written == -1)
+            if (failed.count == 0 || r == MAX_VERIFY_ROUNDS)
                 break;
-        }
 
-        if (buildControlPacket(end_ctrl, filename, len) == -1){
-            perror("Control packet error\n");
-            fclose(fptr);
-            llclose(statistics);
-            exit(EXIT_FAILURE);
+            VerifyList next = {0};
+            for (int n = 0; n < failed.count; n++) {
+                if (failed.items[n] >= (uint64_t)round.count)
+                    continue;
+                int i = round.items[failed.items[n]];
+                printf("Sending %s again\n", list.names[i]);
+                if (sendFile(list.paths[i], list.names[i], &small) == -1) {
+                    failed.count = -1;
+                    break;
+                }
+                addVerifyItem(&next, i);
+            }
+            freeVerifyList(&round);
+            round = next;
+            if (failed.count == -1)
+                break;
         }
+        int result = round.count > 0 && failed.count != 0 ? -1 : 0;
+        if (result == -1)
+            fprintf(stderr, "Some files failed verification\n");
+        freeVerifyList(&round);
+        freeVerifyList(&failed);
+        freeFileList(&list);
 
-        fclose(fptr);
-
-        if (llclose(statistics) == -1){
-            perror("Error disconnecting\n");
+        if (llclose(statistics) == -1 || result == -1){
+            if (result == 0)
+                perror("Error disconnecting\n");
             exit(EXIT_FAILURE);
         }
     }
@@ -184,4 +1230,4 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
         perror("Unidentified Role\n");
         exit(EXIT_FAILURE);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,179 @@
+// Byte ring implementation.
+
+#include "byte_ring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WAITING_SPACE 1
+#define WAITING_DATA 2
+
+int startByteRing(ByteRing *ring, size_t capacity){
+    memset(ring, 0, sizeof(*ring));
+    ring->data = aligned_alloc(CACHE_LINE_SIZE, capacity);
+    if (ring->data == NULL)
+        return -1;
+    ring->capacity = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->sleeping, 0);
+    atomic_init(&ring->closed, 0);
+    pthread_mutex_init(&ring->lock, NULL);
+
+    // Timed waits measure with the monotonic clock, like the link timers
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&ring->wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    return 0;
+}
+
+void freeByteRing(ByteRing *ring){
+    if (ring->data == NULL)
+        return;
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->wake);
+    free(ring->data);
+    ring->data = NULL;
+}
+
+//Wakes the other side up if it sleeps, or is about to
+static void wakeUp(ByteRing *ring, int side){
+    if ((atomic_load(&ring->sleeping) & side) == 0)
+        return;
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void closeByteRing(ByteRing *ring){
+    atomic_store(&ring->closed, 1);
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+size_t ringUsed(ByteRing *ring){
+    return atomic_load(&ring->head) - atomic_load(&ring->tail);
+}
+
+size_t ringSpace(ByteRing *ring, unsigned char **span){
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t offset = head & (ring->capacity - 1);
+    size_t room = ring->capacity - (head - tail);
+
+    *span = ring->data + offset;
+    return room < ring->capacity - offset ? room : ring->capacity - offset;
+}
+
+void ringCommit(ByteRing *ring, size_t size){
+    atomic_fetch_add(&ring->head, size);
+    wakeUp(ring, WAITING_DATA);
+}
+
+size_t ringData(ByteRing *ring, const unsigned char **span){
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t offset = tail & (ring->capacity - 1);
+    size_t used = head - tail;
+
+    *span = ring->data + offset;
+    return used < ring->capacity - offset ? used : ring->capacity - offset;
+}
+
+void ringRelease(ByteRing *ring, size_t size){
+    atomic_fetch_add(&ring->tail, size);
+    wakeUp(ring, WAITING_SPACE);
+}
+
+void ringPut(ByteRing *ring, const void *data, size_t size){
+    const unsigned char *bytes = data;
+    size_t done = 0;
+
+    while (done < size) {
+        unsigned char *span;
+        size_t n = ringSpace(ring, &span);
+        if (n > size - done)
+            n = size - done;
+        memcpy(span, bytes + done, n);
+        atomic_fetch_add(&ring->head, n);
+        done += n;
+    }
+    wakeUp(ring, WAITING_DATA);
+}
+
+void ringGet(ByteRing *ring, void *data, size_t size){
+    unsigned char *bytes = data;
+    size_t done = 0;
+
+    while (done < size) {
+        const unsigned char *span;
+        size_t n = ringData(ring, &span);
+        if (n > size - done)
+            n = size - done;
+        memcpy(bytes + done, span, n);
+        atomic_fetch_add(&ring->tail, n);
+        done += n;
+    }
+    wakeUp(ring, WAITING_SPACE);
+}
+
+//Waits until ready() holds, announcing the wait in "sleeping" before the
+//last look so that the other side cannot miss it
+static int waitFor(ByteRing *ring, int side, size_t size, int timeoutMs, int (*ready)(ByteRing *, size_t)){
+    struct timespec deadline;
+    int result = 1;
+
+    if (ready(ring, size))
+        return 1;
+    if (timeoutMs == 0 || atomic_load(&ring->closed))
+        return 0;
+
+    if (timeoutMs > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeoutMs / 1000;
+        deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_or(&ring->sleeping, side);
+    while (!ready(ring, size)) {
+        if (atomic_load(&ring->closed)) {
+            result = 0;
+            break;
+        }
+        if (timeoutMs < 0)
+            pthread_cond_wait(&ring->wake, &ring->lock);
+        else if (pthread_cond_timedwait(&ring->wake, &ring->lock, &deadline) == ETIMEDOUT) {
+            result = ready(ring, size);
+            break;
+        }
+    }
+    atomic_fetch_and(&ring->sleeping, ~side);
+    pthread_mutex_unlock(&ring->lock);
+    return result;
+}
+
+static int hasSpace(ByteRing *ring, size_t size){
+    return ring->capacity - ringUsed(ring) >= size;
+}
+
+static int hasData(ByteRing *ring, size_t size){
+    return ringUsed(ring) >= size;
+}
+
+int ringWaitSpace(ByteRing *ring, size_t size, int timeoutMs){
+    return waitFor(ring, WAITING_SPACE, size, timeoutMs, hasSpace);
+}
+
+int ringWaitData(ByteRing *ring, size_t size, int timeoutMs){
+    return waitFor(ring, WAITING_DATA, size, timeoutMs, hasData);
+}
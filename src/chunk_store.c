@@ -0,0 +1,134 @@
+// Content-defined chunk store implementation.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "chunk_store.h"
+#include "xxhash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A cut is where the top bits of the gear hash are all 0: more of them
+// before the average size, fewer after it, so that sizes gather around it.
+#define MASK_SMALL (0x7FFFULL << 49) // 15 bits
+#define MASK_LARGE (0x7FFULL << 53)  // 11 bits
+
+static uint64_t gear[256];
+static int gearReady = 0;
+
+//Fills the gear table, the same on every run and every host
+static void makeGear(){
+    uint64_t state = 0x52434F4D43444331ULL;
+
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gearReady = 1;
+}
+
+size_t nextChunk(const unsigned char *data, size_t size){
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN_SIZE;
+
+    if (!gearReady)
+        makeGear();
+    if (size <= CHUNK_MIN_SIZE)
+        return size;
+
+    size_t end = size < CHUNK_MAX_SIZE ? size : CHUNK_MAX_SIZE;
+    size_t normal = end < CHUNK_AVG_SIZE ? end : CHUNK_AVG_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & MASK_SMALL) == 0)
+            return i;
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & MASK_LARGE) == 0)
+            return i;
+    }
+    return end;
+}
+
+int openChunkStore(ChunkStore *store){
+    const char *path = getenv("RX_CHUNK_STORE");
+
+    if (path == NULL || path[0] == '\0' || strlen(path) >= sizeof(store->path) - 32)
+        return -1;
+    strcpy(store->path, path);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+//Path of a chunk: the first byte of its hash names a subdirectory
+static void chunkPath(const ChunkStore *store, uint64_t hash, char *path, size_t size){
+    snprintf(path, size, "%s/%02x/%016llx", store->path, (unsigned)(hash >> 56), (unsigned long long)hash);
+}
+
+int hasChunk(const ChunkStore *store, uint64_t hash, int size){
+    char path[sizeof(store->path) + 32];
+    struct stat st;
+
+    chunkPath(store, hash, path, sizeof(path));
+    return stat(path, &st) == 0 && st.st_size == size;
+}
+
+int loadChunk(const ChunkStore *store, uint64_t hash, int size, unsigned char *data){
+    char path[sizeof(store->path) + 32];
+
+    chunkPath(store, hash, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t n = pread(fd, data, size, 0);
+    close(fd);
+
+    // A damaged chunk is dropped, to be stored again
+    if (n != size || xxh64(data, size, 0) != hash) {
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+int saveChunk(const ChunkStore *store, uint64_t hash, const unsigned char *data, int size){
+    char path[sizeof(store->path) + 32];
+    char temporary[sizeof(store->path) + 40];
+
+    chunkPath(store, hash, path, sizeof(path));
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    // The subdirectory is made on its first chunk
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        return -1;
+    *slash = '/';
+
+    // Written aside and renamed, a chunk is never seen half written
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    if (write(fd, data, size) != size) {
+        close(fd);
+        unlink(temporary);
+        return -1;
+    }
+    close(fd);
+    if (rename(temporary, path) == -1) {
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+// Block compression implementation.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "compression.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Bytes sampled to estimate the entropy of a block: runs spread over it.
+#define SAMPLE_RUNS 64
+#define SAMPLE_RUN_SIZE 32
+
+int offeredCompression(){
+    const char *method = getenv("TX_COMPRESS");
+
+    if (method == NULL || strcmp(method, "lz") == 0)
+        return 1 << COMPRESS_LZ;
+    if (strcmp(method, "off") == 0)
+        return 0;
+
+    fprintf(stderr, "Unknown TX_COMPRESS method '%s', using 'lz'\n", method);
+    return 1 << COMPRESS_LZ;
+}
+
+//Estimates from a sample of its bytes whether a block is worth compressing.
+//Compressed or random data has its byte values close to uniform: their
+//collision entropy is then close to 8 bits, above log2(200) here.
+static int looksCompressible(const unsigned char *data, int size){
+    int counts[256] = {0};
+    long samples = 0;
+    long collisions = 0;
+
+    if (size < SAMPLE_RUNS * SAMPLE_RUN_SIZE * 2)
+        return 1;
+    for (int run = 0; run < SAMPLE_RUNS; run++) {
+        const unsigned char *start = data + (long)run * (size - SAMPLE_RUN_SIZE) / (SAMPLE_RUNS - 1);
+        for (int i = 0; i < SAMPLE_RUN_SIZE; i++)
+            counts[start[i]]++;
+        samples += SAMPLE_RUN_SIZE;
+    }
+    for (int i = 0; i < 256; i++)
+        collisions += (long)counts[i] * counts[i];
+    return collisions * 200 >= samples * samples;
+}
+
+static void writeSize(unsigned char *p, int size){
+    p[0] = size >> 16 & 0xFF;
+    p[1] = size >> 8 & 0xFF;
+    p[2] = size & 0xFF;
+}
+
+static int readSize(const unsigned char *p){
+    return p[0] << 16 | p[1] << 8 | p[2];
+}
+
+int packBlock(const unsigned char *raw, int size, unsigned char *packed){
+    int payload = 0;
+
+    // Incompressible data is sent raw, without even trying
+    if (looksCompressible(raw, size))
+        payload = lzCompress(raw, size, packed + PACKED_HEADER_SIZE, size - 1);
+
+    if (payload > 0) {
+        packed[0] = COMPRESS_LZ;
+    }
+    else {
+        packed[0] = COMPRESS_NONE;
+        memcpy(packed + PACKED_HEADER_SIZE, raw, size);
+        payload = size;
+    }
+    writeSize(packed + 1, size);
+    writeSize(packed + 4, payload);
+    return PACKED_HEADER_SIZE + payload;
+}
+
+int packedBlockSize(const unsigned char *packed, int available){
+    if (available < PACKED_HEADER_SIZE)
+        return -1;
+    return PACKED_HEADER_SIZE + readSize(packed + 4);
+}
+
+int unpackBlock(const unsigned char *packed, int size, unsigned char *raw){
+    if (size < PACKED_HEADER_SIZE)
+        return -1;
+
+    int rawSize = readSize(packed + 1);
+    int payload = readSize(packed + 4);
+    if (PACKED_HEADER_SIZE + payload != size || rawSize > COMPRESS_BLOCK_SIZE)
+        return -1;
+    if (packed[0] == COMPRESS_NONE) {
+        if (payload != rawSize)
+            return -1;
+        memcpy(raw, packed + PACKED_HEADER_SIZE, rawSize);
+        return rawSize;
+    }
+    if (packed[0] == COMPRESS_LZ && lzDecompress(packed + PACKED_HEADER_SIZE, payload, raw, rawSize) == rawSize)
+        return rawSize;
+    return -1;
+}
+
+//Reads a whole block at its offset, retrying short reads
+static int readBlock(int fd, CompressJob *job){
+    int done = 0;
+
+    while (done < job->rawSize) {
+        ssize_t n = pread(fd, job->raw + done, job->rawSize - done, job->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+//Packs or unpacks the jobs submitted, in any order
+static void *compressThread(void *arg){
+    BlockPool *pool = arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->started == pool->submitted && !pool->stop)
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        if (pool->started == pool->submitted) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        CompressJob *job = &pool->jobs[pool->started++ % COMPRESS_JOBS];
+        pthread_mutex_unlock(&pool->lock);
+
+        if (pool->fd >= 0)
+            job->packedSize = readBlock(pool->fd, job) == -1 ? -1 : packBlock(job->raw, job->rawSize, job->packed);
+        else
+            job->rawSize = unpackBlock(job->packed, job->packedSize, job->raw);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+int startBlockPool(BlockPool *pool, int fd){
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(pool, 0, sizeof(*pool));
+    pool->fd = fd;
+    pool->threadCount = processors < 1 ? 1 : processors > MAX_COMPRESS_THREADS ? MAX_COMPRESS_THREADS : processors;
+
+    for (int i = 0; i < COMPRESS_JOBS; i++) {
+        pool->jobs[i].raw = malloc(COMPRESS_BLOCK_SIZE);
+        pool->jobs[i].packed = malloc(PACKED_BLOCK_MAX);
+        if (pool->jobs[i].raw == NULL || pool->jobs[i].packed == NULL) {
+            for (int j = 0; j <= i; j++) {
+                free(pool->jobs[j].raw);
+                free(pool->jobs[j].packed);
+            }
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    for (int i = 0; i < pool->threadCount; i++) {
+        if (pthread_create(&pool->threads[i], NULL, compressThread, pool) != 0) {
+            pool->threadCount = i;
+            stopBlockPool(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+CompressJob *freeJob(BlockPool *pool){
+    if (pool->submitted - pool->taken == COMPRESS_JOBS)
+        return NULL;
+    CompressJob *job = &pool->jobs[pool->submitted % COMPRESS_JOBS];
+    job->done = 0;
+    return job;
+}
+
+void submitJob(BlockPool *pool){
+    pthread_mutex_lock(&pool->lock);
+    pool->submitted++;
+    pthread_cond_signal(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+CompressJob *finishedJob(BlockPool *pool, int wait){
+    if (pool->taken == pool->submitted)
+        return NULL;
+
+    CompressJob *job = &pool->jobs[pool->taken % COMPRESS_JOBS];
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done && wait)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    int done = job->done;
+    pthread_mutex_unlock(&pool->lock);
+    return done ? job : NULL;
+}
+
+void releaseJob(BlockPool *pool){
+    pool->taken++;
+}
+
+void stopBlockPool(BlockPool *pool){
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threadCount; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (int i = 0; i < COMPRESS_JOBS; i++) {
+        free(pool->jobs[i].raw);
+        free(pool->jobs[i].packed);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->queued);
+    pthread_cond_destroy(&pool->finished);
+}
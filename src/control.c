@@ -0,0 +1,209 @@
+// Control packets implementation.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "control.h"
+#include "compression.h"
+#include "delta.h"
+#include "link_layer.h"
+
+#include <string.h>
+
+void putValue(unsigned char *p, uint64_t value, int size){
+    for (int i = size - 1; i >= 0; i--) {
+        p[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+uint64_t getValue(const unsigned char *p, int size){
+    uint64_t value = 0;
+
+    for (int i = 0; i < size; i++)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+void startControl(ControlBuilder *builder, unsigned char *packet, int capacity, int control){
+    builder->packet = packet;
+    builder->capacity = capacity;
+    builder->packet[0] = control;
+    builder->size = 1;
+}
+
+int addField(ControlBuilder *builder, int type, const void *value, int length){
+    if (length > 255 || builder->size + 2 + length > builder->capacity)
+        return -1;
+    builder->packet[builder->size++] = type;
+    builder->packet[builder->size++] = length;
+    memcpy(builder->packet + builder->size, value, length);
+    builder->size += length;
+    return 0;
+}
+
+int addNumberField(ControlBuilder *builder, int type, uint64_t value, int length){
+    unsigned char bytes[8];
+
+    if (length == 0) {
+        for (uint64_t rest = value; rest > 0; rest >>= 8)
+            length++;
+    }
+    putValue(bytes, value, length);
+    return addField(builder, type, bytes, length);
+}
+
+void startParser(ControlParser *parser, const unsigned char *packet, int size){
+    parser->packet = packet;
+    parser->size = size;
+    parser->position = 1;
+}
+
+int nextField(ControlParser *parser, ControlField *field){
+    if (parser->position == parser->size)
+        return 0;
+    if (parser->position + 2 > parser->size
+        || parser->position + 2 + parser->packet[parser->position + 1] > parser->size)
+        return -1;
+
+    field->type = parser->packet[parser->position];
+    field->length = parser->packet[parser->position + 1];
+    field->value = parser->packet + parser->position + 2;
+    parser->position += 2 + field->length;
+    return 1;
+}
+
+int buildControlPacket(int control, const FileSettings *settings){
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    ControlBuilder builder;
+    unsigned char mtime[12];
+    unsigned char offer = 1;
+    int result = 0;
+
+    startControl(&builder, packet, sizeof(packet), control);
+    result |= addNumberField(&builder, FIELD_SIZE, settings->size, 0);
+    result |= addField(&builder, FIELD_NAME, settings->name, strlen(settings->name));
+    if (settings->hashed)
+        result |= addNumberField(&builder, FIELD_HASH, settings->hash, 8);
+    if (settings->compression != 0)
+        result |= addNumberField(&builder, FIELD_COMPRESSION, settings->compression, 1);
+    if (settings->delta)
+        result |= addField(&builder, FIELD_DELTA, &offer, 1);
+    if (settings->chunks)
+        result |= addField(&builder, FIELD_CHUNKS, &offer, 1);
+    if (settings->timed) {
+        putValue(mtime, settings->mtime, 8);
+        putValue(mtime + 8, settings->mtimeNsec, 4);
+        result |= addField(&builder, FIELD_MTIME, mtime, sizeof(mtime));
+    }
+    if (result != 0)
+        return -1;
+    return llwrite(packet, builder.size) == -1 ? -1 : 0;
+}
+
+int parseControlPacket(const unsigned char *packet, int size, FileSettings *settings){
+    ControlParser parser;
+    ControlField field;
+    int sized = 0;
+    int named = 0;
+    int result;
+
+    memset(settings, 0, sizeof(*settings));
+    startParser(&parser, packet, size);
+    while ((result = nextField(&parser, &field)) == 1) {
+        if (field.type == FIELD_SIZE && field.length <= 8) {
+            uint64_t value = getValue(field.value, field.length);
+            if (value > INT64_MAX)
+                return -1;
+            settings->size = value;
+            sized = 1;
+        }
+        else if (field.type == FIELD_NAME) {
+            memcpy(settings->name, field.value, field.length);
+            settings->name[field.length] = '\0';
+            named = 1;
+        }
+        else if (field.type == FIELD_HASH && field.length == 8) {
+            settings->hash = getValue(field.value, 8);
+            settings->hashed = 1;
+        }
+        else if (field.type == FIELD_COMPRESSION && field.length == 1) {
+            settings->compression = field.value[0];
+        }
+        else if (field.type == FIELD_DELTA && field.length == 1) {
+            settings->delta = field.value[0] == 1;
+        }
+        else if (field.type == FIELD_CHUNKS && field.length == 1) {
+            settings->chunks = field.value[0] == 1;
+        }
+        else if (field.type == FIELD_MTIME && field.length == 12) {
+            settings->mtime = (int64_t)getValue(field.value, 8);
+            settings->mtimeNsec = getValue(field.value + 8, 4);
+            settings->timed = settings->mtimeNsec < 1000000000;
+        }
+    }
+    return result == -1 || !sized || !named ? -1 : 0;
+}
+
+int buildResumePacket(const AcceptedSettings *settings){
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    ControlBuilder builder;
+    unsigned char basis[20];
+    unsigned char accept = 1;
+    int result = 0;
+
+    // The offset always takes 8 bytes, as older transmitters expect
+    startControl(&builder, packet, sizeof(packet), PACKET_RESUME);
+    result |= addNumberField(&builder, FIELD_OFFSET, settings->offset, 8);
+    if (settings->compression != COMPRESS_NONE)
+        result |= addNumberField(&builder, FIELD_COMPRESSION, settings->compression, 1);
+    if (settings->basisBlockSize > 0) {
+        putValue(basis, settings->basisBlockSize, 4);
+        putValue(basis + 4, settings->basisSize, 8);
+        putValue(basis + 12, settings->basisRoot, 8);
+        result |= addField(&builder, FIELD_DELTA, basis, sizeof(basis));
+    }
+    if (settings->chunks)
+        result |= addField(&builder, FIELD_CHUNKS, &accept, 1);
+    if (result != 0)
+        return -1;
+    return llwrite(packet, builder.size) == -1 ? -1 : 0;
+}
+
+int readResumePacket(AcceptedSettings *settings){
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    ControlParser parser;
+    ControlField field;
+    int offset = 0;
+    int result;
+    int size;
+
+    while ((size = llread(packet)) == -1);
+    if (size < 1 || packet[0] != PACKET_RESUME)
+        return -1;
+
+    memset(settings, 0, sizeof(*settings));
+    startParser(&parser, packet, size);
+    while ((result = nextField(&parser, &field)) == 1) {
+        if (field.type == FIELD_OFFSET && field.length <= 8) {
+            uint64_t value = getValue(field.value, field.length);
+            if (value > INT64_MAX)
+                return -1;
+            settings->offset = value;
+            offset = 1;
+        }
+        else if (field.type == FIELD_COMPRESSION && field.length == 1) {
+            settings->compression = field.value[0];
+        }
+        else if (field.type == FIELD_DELTA && field.length == 20) {
+            settings->basisBlockSize = getValue(field.value, 4);
+            settings->basisSize = getValue(field.value + 4, 8);
+            settings->basisRoot = getValue(field.value + 12, 8);
+            if (settings->basisBlockSize > DELTA_MAX_BLOCK || settings->basisSize < 0)
+                return -1;
+        }
+        else if (field.type == FIELD_CHUNKS && field.length == 1) {
+            settings->chunks = field.value[0] == 1;
+        }
+    }
+    return result == -1 || !offset ? -1 : 0;
+}
@@ -0,0 +1,264 @@
+// Delta transfer implementation.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "delta.h"
+#include "file_hash.h"
+#include "xxhash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The checksum of rsync: s1 is the sum of the bytes, s2 the sum of the
+// partial sums, both modulo 2^16.
+uint32_t weakChecksum(const unsigned char *data, int size){
+    uint32_t s1 = 0;
+    uint32_t s2 = 0;
+
+    for (int i = 0; i < size; i++) {
+        s1 += data[i];
+        s2 += s1;
+    }
+    return (s1 & 0xFFFF) | s2 << 16;
+}
+
+//Chooses a block size close to the square root of the file size
+static int deltaBlockSize(off_t size){
+    int blockSize = DELTA_MIN_BLOCK;
+
+    while (blockSize < DELTA_MAX_BLOCK && (off_t)blockSize * blockSize < size)
+        blockSize *= 2;
+    return blockSize;
+}
+
+//Reads up to size bytes, retrying short reads
+static ssize_t readFully(int fd, unsigned char *data, size_t size){
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+int openBasis(Basis *basis, const char *filename){
+    struct stat st;
+
+    memset(basis, 0, sizeof(*basis));
+    basis->fd = open(filename, O_RDONLY);
+    if (basis->fd < 0)
+        return -1;
+    if (fstat(basis->fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(basis->fd);
+        return -1;
+    }
+    basis->size = st.st_size;
+    basis->blockSize = deltaBlockSize(st.st_size);
+    basis->signatures = malloc((st.st_size / basis->blockSize + 1) * sizeof(BlockSignature));
+    unsigned char *block = malloc(basis->blockSize);
+    if (basis->signatures == NULL || block == NULL) {
+        free(block);
+        closeBasis(basis);
+        return -1;
+    }
+
+    // One pass makes the signatures and the root hash of the basis
+    BlockHasher hasher;
+    BlockHash hash;
+    Xxh64State root;
+    off_t offset = 0;
+    startBlockHasher(&hasher, basis->size);
+    xxh64Reset(&root, 0);
+    while (offset < basis->size) {
+        ssize_t n = readFully(basis->fd, block, basis->blockSize);
+        if (n <= 0) {
+            free(block);
+            closeBasis(basis);
+            return -1;
+        }
+        if (n == basis->blockSize) {
+            basis->signatures[basis->count].weak = weakChecksum(block, n);
+            basis->signatures[basis->count].strong = xxh64(block, n, 0);
+            basis->count++;
+        }
+        if (hashBlockData(&hasher, offset, block, n, &hash))
+            rootUpdate(&root, hash.hash);
+        offset += n;
+    }
+    basis->root = xxh64Digest(&root);
+    free(block);
+    return 0;
+}
+
+void closeBasis(Basis *basis){
+    if (basis->fd >= 0)
+        close(basis->fd);
+    free(basis->signatures);
+    memset(basis, 0, sizeof(*basis));
+    basis->fd = -1;
+}
+
+// Blocks of the basis by weak checksum: chains of block numbers.
+typedef struct
+{
+    int mask;
+    int *heads; // First block of each bucket, plus one
+    int *next;  // Next block in the same bucket, plus one
+} SignatureIndex;
+
+static int buildIndex(SignatureIndex *index, const BlockSignature *signatures, int count){
+    int size = 1;
+
+    while (size < 2 * count)
+        size *= 2;
+    index->mask = size - 1;
+    index->heads = calloc(size, sizeof(int));
+    index->next = calloc(count + 1, sizeof(int));
+    if (index->heads == NULL || index->next == NULL) {
+        free(index->heads);
+        free(index->next);
+        return -1;
+    }
+
+    // Walked backwards, every chain lists its blocks in file order
+    for (int i = count - 1; i >= 0; i--) {
+        int bucket = (signatures[i].weak * 2654435761u) & index->mask;
+        index->next[i] = index->heads[bucket];
+        index->heads[bucket] = i + 1;
+    }
+    return 0;
+}
+
+//Delta being made: the literal run and the copy not handed out yet
+typedef struct
+{
+    const DeltaOutput *output;
+    off_t literal;     // Start of the literal data not handed out
+    off_t copy;        // Start of the pending copy in the file
+    off_t copyBasis;   // and in the basis
+    off_t copySize;    // 0 if there is none
+} DeltaState;
+
+static int flushCopy(DeltaState *state){
+    if (state->copySize == 0)
+        return 0;
+    int result = state->output->copy(state->output->context, state->copy, state->copyBasis, state->copySize);
+    state->copySize = 0;
+    return result;
+}
+
+//Hands out the literal data up to offset, after the pending copy
+static int flushLiteral(DeltaState *state, off_t offset){
+    if (offset == state->literal)
+        return 0;
+    if (flushCopy(state) == -1)
+        return -1;
+    int result = state->output->literal(state->output->context, state->literal, offset - state->literal);
+    state->literal = offset;
+    return result;
+}
+
+//Adds a copy of the block found at offset, extending the pending copy if it follows it
+static int addCopy(DeltaState *state, off_t offset, off_t basisOffset, int blockSize){
+    if (flushLiteral(state, offset) == -1)
+        return -1;
+    if (state->copySize > 0 && state->copy + state->copySize == offset
+        && state->copyBasis + state->copySize == basisOffset) {
+        state->copySize += blockSize;
+    }
+    else {
+        if (flushCopy(state) == -1)
+            return -1;
+        state->copy = offset;
+        state->copyBasis = basisOffset;
+        state->copySize = blockSize;
+    }
+    state->literal = offset + blockSize;
+    return 0;
+}
+
+int computeDelta(const unsigned char *data, off_t size, const BlockSignature *signatures, int count,
+                 int blockSize, const DeltaOutput *output){
+    DeltaState state = {output, 0, 0, 0, 0};
+    SignatureIndex index;
+    off_t offset = 0;
+    int result = 0;
+
+    if (count == 0 || size < blockSize || buildIndex(&index, signatures, count) == -1)
+        return flushLiteral(&state, size);
+
+    uint32_t s1 = 0;
+    uint32_t s2 = 0;
+    for (int i = 0; i < blockSize; i++) {
+        s1 += data[i];
+        s2 += s1;
+    }
+
+    while (offset + blockSize <= size) {
+        uint32_t weak = (s1 & 0xFFFF) | s2 << 16;
+        int found = -1;
+        int hashed = 0;
+        uint64_t strong = 0;
+
+        // The block after the pending copy is the likeliest, then the others
+        int expected = state.copySize > 0 && state.copy + state.copySize == offset
+                           ? (int)((state.copyBasis + state.copySize) / blockSize) : -1;
+        if (expected >= 0 && expected < count && signatures[expected].weak == weak) {
+            strong = xxh64(data + offset, blockSize, 0);
+            hashed = 1;
+            if (signatures[expected].strong == strong)
+                found = expected;
+        }
+        for (int i = index.heads[(weak * 2654435761u) & index.mask]; found < 0 && i > 0; i = index.next[i - 1]) {
+            if (signatures[i - 1].weak != weak)
+                continue;
+            if (!hashed) {
+                strong = xxh64(data + offset, blockSize, 0);
+                hashed = 1;
+            }
+            if (signatures[i - 1].strong == strong)
+                found = i - 1;
+        }
+
+        if (found >= 0) {
+            if ((result = addCopy(&state, offset, (off_t)found * blockSize, blockSize)) == -1)
+                break;
+            offset += blockSize;
+            if (offset + blockSize > size)
+                break;
+            s1 = 0;
+            s2 = 0;
+            for (int i = 0; i < blockSize; i++) {
+                s1 += data[offset + i];
+                s2 += s1;
+            }
+            continue;
+        }
+
+        // Roll the checksum one byte further
+        if (offset + blockSize < size) {
+            s1 += data[offset + blockSize] - data[offset];
+            s2 += s1 - (uint32_t)blockSize * data[offset];
+        }
+        offset++;
+    }
+
+    free(index.heads);
+    free(index.next);
+    if (result == -1)
+        return -1;
+    if (flushLiteral(&state, size) == -1)
+        return -1;
+    return flushCopy(&state);
+}
@@ -0,0 +1,207 @@
+// End-to-end file verification implementation.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "file_hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void rootUpdate(Xxh64State *root, uint64_t hash){
+    unsigned char bytes[8];
+
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = hash & 0xFF;
+        hash >>= 8;
+    }
+    xxh64Update(root, bytes, sizeof(bytes));
+}
+
+void startBlockHasher(BlockHasher *hasher, off_t fileSize){
+    hasher->fileSize = fileSize;
+    hasher->next = -1;
+}
+
+int hashBlockData(BlockHasher *hasher, off_t offset, const unsigned char *data, size_t size, BlockHash *block){
+    int completed = 0;
+
+    // Data packets are not aligned to blocks: one may end a block and start the next
+    while (size > 0 && offset < hasher->fileSize) {
+        off_t blockOffset = offset - offset % HASH_BLOCK_SIZE;
+        off_t blockEnd = blockOffset + HASH_BLOCK_SIZE;
+        if (blockEnd > hasher->fileSize)
+            blockEnd = hasher->fileSize;
+        size_t n = blockEnd - offset < (off_t)size ? (size_t)(blockEnd - offset) : size;
+
+        if (offset == blockOffset) {
+            xxh64Reset(&hasher->state, 0);
+            hasher->next = offset;
+        }
+        if (hasher->next == offset) {
+            xxh64Update(&hasher->state, data, n);
+            hasher->next += n;
+        }
+        else {
+            // Data of this block went missing: it cannot be hashed
+            hasher->next = -1;
+        }
+
+        if (hasher->next == blockEnd) {
+            block->offset = blockOffset;
+            block->hash = xxh64Digest(&hasher->state);
+            hasher->next = -1;
+            completed = 1;
+        }
+        offset += n;
+        data += n;
+        size -= n;
+    }
+    return completed;
+}
+
+int addBlockHash(BlockHashList *list, off_t offset, uint64_t hash){
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        BlockHash *blocks = realloc(list->blocks, capacity * sizeof(BlockHash));
+        if (blocks == NULL)
+            return -1;
+        list->blocks = blocks;
+        list->capacity = capacity;
+    }
+    list->blocks[list->count].offset = offset;
+    list->blocks[list->count].hash = hash;
+    list->count++;
+    return 0;
+}
+
+int addVerifyItem(VerifyList *list, uint64_t item){
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        uint64_t *items = realloc(list->items, capacity * sizeof(uint64_t));
+        if (items == NULL)
+            return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = item;
+    return 0;
+}
+
+void freeVerifyList(VerifyList *list){
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+//Returns the position of the block at offset in the list, or -1
+static int findBlock(const BlockHashList *list, off_t offset){
+    for (int i = 0; i < list->count; i++) {
+        if (list->blocks[i].offset == offset)
+            return i;
+    }
+    return -1;
+}
+
+static void removeBlock(BlockHashList *list, int i){
+    list->blocks[i] = list->blocks[--list->count];
+}
+
+void freeBlockHashList(BlockHashList *list){
+    free(list->blocks);
+    memset(list, 0, sizeof(*list));
+}
+
+void startVerifier(Verifier *verifier, off_t fileSize){
+    memset(verifier, 0, sizeof(*verifier));
+    startBlockHasher(&verifier->hasher, fileSize);
+    xxh64Reset(&verifier->root, 0);
+}
+
+void freeVerifier(Verifier *verifier){
+    freeBlockHashList(&verifier->pending);
+    freeBlockHashList(&verifier->bad);
+}
+
+void verifyData(Verifier *verifier, off_t offset, const unsigned char *data, size_t size){
+    BlockHash block;
+
+    if (!hashBlockData(&verifier->hasher, offset, data, size, &block))
+        return;
+
+    // A block sent again is good once it has the hash announced for it
+    int i = findBlock(&verifier->bad, block.offset);
+    if (i >= 0) {
+        if (verifier->bad.blocks[i].hash == block.hash)
+            removeBlock(&verifier->bad, i);
+        return;
+    }
+
+    i = findBlock(&verifier->pending, block.offset);
+    if (i >= 0)
+        verifier->pending.blocks[i].hash = block.hash;
+    else if (addBlockHash(&verifier->pending, block.offset, block.hash) == -1)
+        verifier->announced = -1;
+}
+
+void verifyHashes(Verifier *verifier, off_t offset, const unsigned char *hashes, int count){
+    off_t fileSize = verifier->hasher.fileSize;
+
+    for (int n = 0; n < count; n++) {
+        off_t blockOffset = offset + (off_t)n * HASH_BLOCK_SIZE;
+        uint64_t hash = 0;
+        for (int i = 0; i < 8; i++)
+            hash = (hash << 8) | hashes[8 * n + i];
+
+        // Hashes come in order, each block once
+        if (verifier->announced != blockOffset || blockOffset >= fileSize) {
+            verifier->announced = -1;
+            return;
+        }
+        rootUpdate(&verifier->root, hash);
+        verifier->announced = blockOffset + HASH_BLOCK_SIZE < fileSize ? blockOffset + HASH_BLOCK_SIZE : fileSize;
+
+        int i = findBlock(&verifier->pending, blockOffset);
+        if (i >= 0 && verifier->pending.blocks[i].hash == hash) {
+            removeBlock(&verifier->pending, i);
+            continue;
+        }
+        if (i >= 0)
+            removeBlock(&verifier->pending, i);
+        if (addBlockHash(&verifier->bad, blockOffset, hash) == -1) {
+            verifier->announced = -1;
+            return;
+        }
+    }
+}
+
+//Compares an ascending order of block offsets
+static int compareBlocks(const void *a, const void *b){
+    off_t x = ((const BlockHash *)a)->offset;
+    off_t y = ((const BlockHash *)b)->offset;
+    return (x > y) - (x < y);
+}
+
+int verifyEnd(Verifier *verifier, uint64_t root){
+    off_t fileSize = verifier->hasher.fileSize;
+
+    // Small files come without HASHES: the receiver's own hashes make the root
+    if (verifier->announced == 0 && fileSize > 0) {
+        Xxh64State own;
+        off_t covered = 0;
+
+        xxh64Reset(&own, 0);
+        qsort(verifier->pending.blocks, verifier->pending.count, sizeof(BlockHash), compareBlocks);
+        for (int i = 0; i < verifier->pending.count; i++) {
+            if (verifier->pending.blocks[i].offset != covered)
+                return -1;
+            rootUpdate(&own, verifier->pending.blocks[i].hash);
+            covered = covered + HASH_BLOCK_SIZE < fileSize ? covered + HASH_BLOCK_SIZE : fileSize;
+        }
+        return covered == fileSize && xxh64Digest(&own) == root ? 0 : -1;
+    }
+
+    if (verifier->announced != fileSize || xxh64Digest(&verifier->root) != root)
+        return -1;
+
+    qsort(verifier->bad.blocks, verifier->bad.count, sizeof(BlockHash), compareBlocks);
+    return verifier->bad.count;
+}
@@ -0,0 +1,155 @@
+// Transmitter file list implementation.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "file_list.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//Adds a file to the list, with copies of its path and name
+static int addFile(FileList *list, const char *path, const char *name){
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL)
+            return -1;
+        list->paths = paths;
+        char **names = realloc(list->names, capacity * sizeof(char *));
+        if (names == NULL)
+            return -1;
+        list->names = names;
+        list->capacity = capacity;
+    }
+
+    list->paths[list->count] = strdup(path);
+    list->names[list->count] = strdup(name);
+    if (list->paths[list->count] == NULL || list->names[list->count] == NULL) {
+        free(list->paths[list->count]);
+        free(list->names[list->count]);
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+//Adds the regular files under a directory, in name order
+static int addDirectory(FileList *list, const char *path, const char *name){
+    struct dirent **entries;
+    int n = scandir(path, &entries, NULL, alphasort);
+    int result = 0;
+
+    if (n < 0)
+        return -1;
+
+    for (int i = 0; i < n; i++) {
+        const char *entry = entries[i]->d_name;
+        char entryPath[4096];
+        char entryName[4096];
+        struct stat st;
+
+        if (result == -1 || strcmp(entry, ".") == 0 || strcmp(entry, "..") == 0) {
+            free(entries[i]);
+            continue;
+        }
+
+        snprintf(entryPath, sizeof(entryPath), "%s/%s", path, entry);
+        snprintf(entryName, sizeof(entryName), "%s/%s", name, entry);
+        if (lstat(entryPath, &st) == -1)
+            result = -1;
+        else if (S_ISDIR(st.st_mode))
+            result = addDirectory(list, entryPath, entryName);
+        else if (S_ISREG(st.st_mode))
+            result = addFile(list, entryPath, entryName);
+        free(entries[i]);
+    }
+    free(entries);
+    return result;
+}
+
+//Returns the last component of a path, ignoring trailing slashes
+static void baseName(const char *path, char *name, size_t size){
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/')
+        end--;
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+    if (end - start >= size)
+        end = start + size - 1;
+    memcpy(name, path + start, end - start);
+    name[end - start] = '\0';
+}
+
+//Adds the files listed in a manifest, one path per line
+static int addManifest(FileList *list, const char *manifest){
+    FILE *fptr = fopen(manifest, "r");
+    char line[4096];
+    int result = 0;
+
+    if (fptr == NULL)
+        return -1;
+
+    while (result == 0 && fgets(line, sizeof(line), fptr) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        // Paths are sent relative, without their leading slashes
+        const char *name = line;
+        struct stat st;
+        while (*name == '/')
+            name++;
+        if (stat(line, &st) == -1)
+            result = -1;
+        else if (S_ISDIR(st.st_mode))
+            result = addDirectory(list, line, name);
+        else
+            result = addFile(list, line, name);
+    }
+    fclose(fptr);
+    return result;
+}
+
+int buildFileList(const char *source, FileList *list){
+    struct stat st;
+    char name[256];
+    int result;
+
+    memset(list, 0, sizeof(*list));
+
+    if (source[0] == '@') {
+        result = addManifest(list, source + 1);
+    }
+    else if (stat(source, &st) == -1) {
+        result = -1;
+    }
+    else {
+        baseName(source, name, sizeof(name));
+        if (S_ISDIR(st.st_mode))
+            result = addDirectory(list, source, name);
+        else
+            result = addFile(list, source, name);
+    }
+
+    if (result == -1) {
+        int error = errno;
+        freeFileList(list);
+        errno = error;
+    }
+    return result;
+}
+
+void freeFileList(FileList *list){
+    for (int i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+        free(list->names[i]);
+    }
+    free(list->paths);
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+}
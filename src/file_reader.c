@@ -0,0 +1,198 @@
+// Transmitter file reader implementation.
+// Regular files are mapped, and every data packet is a slice of the mapping
+// that the link layer stuffs straight into its frame. Other files are read
+// by a thread that fills a ring of data packets ahead of the link, so that
+// the storage latency overlaps with the time frames spend on the line.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "file_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Reads up to size bytes, retrying short reads
+static ssize_t readFully(int fd, unsigned char *data, size_t size){
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+//Builds the header of a data packet with datasize bytes from offset
+static void buildDataHeader(PacketBuffer *slot, off_t offset, int datasize){
+    slot->header[0] = PACKET_DATA;
+    slot->header[1] = datasize >> 8 & 0xFF;
+    slot->header[2] = datasize & 0xFF;
+    for (int i = 10; i >= 3; i--) {
+        slot->header[i] = offset & 0xFF;
+        offset >>= 8;
+    }
+    slot->size = datasize + DATA_HEADER_SIZE;
+}
+
+//Fills the ring with data packets
+static void *readerThread(void *arg){
+    FileReader *reader = arg;
+    off_t offset = reader->offset;
+    int tail = 0;
+
+    while (1) {
+        pthread_mutex_lock(&reader->lock);
+        while (reader->count == READ_AHEAD_PACKETS && !reader->stop)
+            pthread_cond_wait(&reader->notFull, &reader->lock);
+        if (reader->stop) {
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        }
+        pthread_mutex_unlock(&reader->lock);
+
+        // The slot past the last filled one is not seen by the link yet
+        PacketBuffer *slot = &reader->ring[tail];
+        ssize_t datasize = readFully(reader->fd, slot->storage, MAX_DATA_SIZE);
+        slot->data = slot->storage;
+        if (datasize > 0)
+            buildDataHeader(slot, offset, datasize);
+        else
+            slot->size = datasize;
+        offset += datasize;
+        tail = (tail + 1) % READ_AHEAD_PACKETS;
+
+        pthread_mutex_lock(&reader->lock);
+        reader->count++;
+        pthread_cond_signal(&reader->notEmpty);
+        pthread_mutex_unlock(&reader->lock);
+
+        if (datasize <= 0)
+            break;
+    }
+    return NULL;
+}
+
+int openFileReader(FileReader *reader, const char *filename){
+    struct stat st;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = open(filename, O_RDONLY);
+    if (reader->fd < 0)
+        return -1;
+
+    if (fstat(reader->fd, &st) < 0) {
+        close(reader->fd);
+        return -1;
+    }
+    reader->fileSize = st.st_size;
+
+    // Files larger than the address space are read by the thread instead
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (map != MAP_FAILED) {
+            // Let the kernel read further ahead and drop pages once sent
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            reader->map = map;
+            return 0;
+        }
+    }
+
+    // Let the kernel read further ahead than it would by default
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+int startFileReader(FileReader *reader, off_t offset){
+    reader->offset = offset;
+    reader->dropped = offset - offset % sysconf(_SC_PAGESIZE);
+    if (reader->map != NULL)
+        return 0;
+
+    // Files that cannot be mapped may not be seekable either
+    if (offset > 0 && lseek(reader->fd, offset, SEEK_SET) == -1)
+        return -1;
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->notEmpty, NULL);
+    pthread_cond_init(&reader->notFull, NULL);
+
+    if (pthread_create(&reader->thread, NULL, readerThread, reader) != 0)
+        return -1;
+    reader->started = 1;
+    return 0;
+}
+
+const PacketBuffer *nextPacket(FileReader *reader){
+    if (reader->map != NULL) {
+        PacketBuffer *slot = &reader->ring[0];
+        off_t left = reader->fileSize - reader->offset;
+        slot->data = reader->map + reader->offset;
+        if (left > 0)
+            buildDataHeader(slot, reader->offset, left > MAX_DATA_SIZE ? MAX_DATA_SIZE : left);
+        else
+            slot->size = 0;
+        return slot;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    while (reader->count == 0)
+        pthread_cond_wait(&reader->notEmpty, &reader->lock);
+    const PacketBuffer *slot = &reader->ring[reader->head];
+    pthread_mutex_unlock(&reader->lock);
+    return slot;
+}
+
+void releasePacket(FileReader *reader){
+    if (reader->map != NULL) {
+        reader->offset += reader->ring[0].size - DATA_HEADER_SIZE;
+        if (reader->offset - reader->dropped >= DROP_BEHIND_SIZE) {
+            off_t end = reader->offset - reader->offset % sysconf(_SC_PAGESIZE);
+            madvise((void *)(reader->map + reader->dropped), end - reader->dropped, MADV_DONTNEED);
+            reader->dropped = end;
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    reader->head = (reader->head + 1) % READ_AHEAD_PACKETS;
+    reader->count--;
+    pthread_cond_signal(&reader->notFull);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+void closeFileReader(FileReader *reader){
+    if (reader->map != NULL) {
+        munmap((void *)reader->map, reader->fileSize);
+        close(reader->fd);
+        return;
+    }
+    if (!reader->started) {
+        close(reader->fd);
+        return;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_signal(&reader->notFull);
+    pthread_mutex_unlock(&reader->lock);
+
+    pthread_join(reader->thread, NULL);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->notEmpty);
+    pthread_cond_destroy(&reader->notFull);
+    close(reader->fd);
+}
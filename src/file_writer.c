@@ -0,0 +1,296 @@
+// Receiver file writer implementation.
+// Received data is collected in large aligned buffers, which a writer thread
+// flushes with pwrite, so that disk writes never hold up llread. After every
+// buffer, the writer thread records in a checkpoint sidecar how much of the
+// file is on the disk, so that an interrupted transfer can be resumed.
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "file_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Reads the fsync policy from the environment
+static FsyncPolicy readFsyncPolicy(){
+    const char *policy = getenv("RX_FSYNC");
+
+    if (policy == NULL || strcmp(policy, "never") == 0)
+        return FsyncNever;
+    if (strcmp(policy, "close") == 0)
+        return FsyncOnClose;
+    if (strcmp(policy, "always") == 0)
+        return FsyncAlways;
+
+    fprintf(stderr, "Unknown RX_FSYNC policy '%s', using 'never'\n", policy);
+    return FsyncNever;
+}
+
+//Writes a whole buffer at its offset, retrying short writes
+static int writeBuffer(int fd, const WriteBuffer *buffer){
+    size_t done = 0;
+
+    while (done < buffer->used) {
+        ssize_t n = pwrite(fd, buffer->data + done, buffer->used - done, buffer->offset + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+//Records that the first "persisted" bytes of the file are on the disk
+static int saveCheckpoint(FileWriter *writer, off_t persisted){
+    Checkpoint checkpoint;
+
+    if (writer->checkpointFd < 0)
+        return 0;
+    memcpy(checkpoint.magic, CHECKPOINT_MAGIC, sizeof(checkpoint.magic));
+    checkpoint.size = writer->announcedSize;
+    checkpoint.persisted = persisted;
+    if (pwrite(writer->checkpointFd, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint))
+        return -1;
+    return 0;
+}
+
+//Flushes the buffers handed over by llread, oldest first
+static void *writerThread(void *arg){
+    FileWriter *writer = arg;
+
+    while (1) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->queued == 0 && !writer->stop)
+            pthread_cond_wait(&writer->notEmpty, &writer->lock);
+        if (writer->queued == 0) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+        WriteBuffer *buffer = &writer->ring[writer->head];
+        int failed = writer->error != 0;
+        pthread_mutex_unlock(&writer->lock);
+
+        // Once a write failed, the rest is dropped: the transfer is lost
+        int error = 0;
+        if (!failed && writeBuffer(writer->fd, buffer) == -1)
+            error = errno;
+        if (!failed && error == 0 && writer->fsyncPolicy == FsyncAlways && fdatasync(writer->fd) == -1)
+            error = errno;
+
+        // The checkpoint only covers data written after everything before it
+        pthread_mutex_lock(&writer->lock);
+        off_t end = buffer->offset + buffer->used;
+        int moved = !failed && error == 0 && buffer->offset <= writer->persisted && end > writer->persisted;
+        if (moved)
+            writer->persisted = end;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (moved && saveCheckpoint(writer, end) == -1)
+            error = errno;
+
+        pthread_mutex_lock(&writer->lock);
+        if (error != 0 && writer->error == 0)
+            writer->error = error;
+        writer->head = (writer->head + 1) % WRITE_BUFFERS;
+        writer->queued--;
+        pthread_cond_signal(&writer->notFull);
+        pthread_mutex_unlock(&writer->lock);
+    }
+    return NULL;
+}
+
+//Hands the buffer being filled to the writer thread and returns the next one
+static WriteBuffer *submitBuffer(FileWriter *writer){
+    pthread_mutex_lock(&writer->lock);
+    writer->queued++;
+    pthread_cond_signal(&writer->notEmpty);
+    while (writer->queued == WRITE_BUFFERS)
+        pthread_cond_wait(&writer->notFull, &writer->lock);
+    WriteBuffer *next = &writer->ring[(writer->head + writer->queued) % WRITE_BUFFERS];
+    pthread_mutex_unlock(&writer->lock);
+
+    next->used = 0;
+    next->offset = writer->nextOffset;
+    writer->bufferStarted = time(NULL);
+    return next;
+}
+
+//Opens the checkpoint of filename and reads how much of it can be kept
+static int openCheckpoint(FileWriter *writer, const char *filename, off_t *resume){
+    Checkpoint checkpoint;
+    struct stat st;
+
+    *resume = 0;
+    if (snprintf(writer->checkpointName, sizeof(writer->checkpointName), "%s%s", filename, CHECKPOINT_SUFFIX)
+        >= (int)sizeof(writer->checkpointName)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    writer->checkpointFd = open(writer->checkpointName, O_RDWR | O_CREAT, 0644);
+    if (writer->checkpointFd < 0)
+        return -1;
+
+    // Resume only the same file: same size, and still holding what was written
+    if (pread(writer->checkpointFd, &checkpoint, sizeof(checkpoint), 0) == sizeof(checkpoint)
+        && memcmp(checkpoint.magic, CHECKPOINT_MAGIC, sizeof(checkpoint.magic)) == 0
+        && checkpoint.size == (uint64_t)writer->announcedSize && checkpoint.persisted <= checkpoint.size
+        && stat(filename, &st) == 0 && st.st_size >= (off_t)checkpoint.persisted)
+        *resume = checkpoint.persisted;
+    return 0;
+}
+
+int openFileWriter(FileWriter *writer, const char *filename, off_t announcedSize, off_t *resumeOffset){
+    off_t resume = 0;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->fsyncPolicy = readFsyncPolicy();
+    writer->announcedSize = announcedSize;
+    writer->checkpointFd = -1;
+
+    if (resumeOffset != NULL) {
+        if (openCheckpoint(writer, filename, &resume) == -1)
+            return -1;
+        *resumeOffset = resume;
+    }
+
+    writer->fd = open(filename, O_WRONLY | O_CREAT | (resume == 0 ? O_TRUNC : 0), 0644);
+    if (writer->fd < 0 || saveCheckpoint(writer, resume) == -1) {
+        if (writer->fd >= 0)
+            close(writer->fd);
+        if (writer->checkpointFd >= 0)
+            close(writer->checkpointFd);
+        return -1;
+    }
+    writer->nextOffset = resume;
+    writer->endOffset = resume;
+    writer->persisted = resume;
+
+    // Reserve the whole file now, so that it is not fragmented as it grows.
+    // Not every file system can, and the writes still work without it.
+    if (announcedSize > 0 && fallocate(writer->fd, 0, 0, announcedSize) == -1 && errno != EOPNOTSUPP)
+        perror("fallocate");
+
+    for (int i = 0; i < WRITE_BUFFERS; i++) {
+        void *data;
+        if (posix_memalign(&data, 4096, WRITE_BUFFER_SIZE) != 0) {
+            for (int j = 0; j < i; j++)
+                free(writer->ring[j].data);
+            close(writer->fd);
+            close(writer->checkpointFd);
+            return -1;
+        }
+        writer->ring[i].data = data;
+    }
+    writer->ring[0].offset = resume;
+    writer->bufferStarted = time(NULL);
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->notEmpty, NULL);
+    pthread_cond_init(&writer->notFull, NULL);
+
+    if (pthread_create(&writer->thread, NULL, writerThread, writer) != 0) {
+        for (int i = 0; i < WRITE_BUFFERS; i++)
+            free(writer->ring[i].data);
+        close(writer->fd);
+        close(writer->checkpointFd);
+        return -1;
+    }
+    return 0;
+}
+
+int writeData(FileWriter *writer, off_t offset, const unsigned char *data, size_t size){
+    pthread_mutex_lock(&writer->lock);
+    int error = writer->error;
+    WriteBuffer *buffer = &writer->ring[(writer->head + writer->queued) % WRITE_BUFFERS];
+    pthread_mutex_unlock(&writer->lock);
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    // A buffer holds contiguous data only
+    if (offset != writer->nextOffset) {
+        if (buffer->used > 0)
+            buffer = submitBuffer(writer);
+        writer->nextOffset = offset;
+        buffer->offset = offset;
+    }
+
+    while (size > 0) {
+        size_t n = WRITE_BUFFER_SIZE - buffer->used;
+        if (n > size)
+            n = size;
+        memcpy(buffer->data + buffer->used, data, n);
+        buffer->used += n;
+        writer->nextOffset += n;
+        data += n;
+        size -= n;
+
+        if (buffer->used == WRITE_BUFFER_SIZE)
+            buffer = submitBuffer(writer);
+    }
+    if (writer->nextOffset > writer->endOffset)
+        writer->endOffset = writer->nextOffset;
+
+    // On slow links a buffer takes long to fill: keep the checkpoint moving
+    if (buffer->used > 0 && time(NULL) - writer->bufferStarted >= CHECKPOINT_SECONDS)
+        submitBuffer(writer);
+    return 0;
+}
+
+int closeFileWriter(FileWriter *writer, int complete){
+    pthread_mutex_lock(&writer->lock);
+    WriteBuffer *buffer = &writer->ring[(writer->head + writer->queued) % WRITE_BUFFERS];
+    if (buffer->used > 0) {
+        writer->queued++;
+        pthread_cond_signal(&writer->notEmpty);
+    }
+    writer->stop = 1;
+    pthread_cond_signal(&writer->notEmpty);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+
+    int error = writer->error;
+    if (writer->persisted < writer->endOffset)
+        complete = 0;
+
+    if (complete) {
+        // Drop what was reserved and never received
+        if (error == 0 && ftruncate(writer->fd, writer->endOffset) == -1)
+            error = errno;
+        if (error == 0 && writer->fsyncPolicy != FsyncNever && fsync(writer->fd) == -1)
+            error = errno;
+        if (error == 0 && writer->checkpointFd >= 0)
+            unlink(writer->checkpointName);
+    }
+    else if (writer->fsyncPolicy != FsyncNever) {
+        if (fsync(writer->fd) == -1 || (writer->checkpointFd >= 0 && fsync(writer->checkpointFd) == -1))
+            error = error == 0 ? errno : error;
+    }
+    if (close(writer->fd) == -1 && error == 0)
+        error = errno;
+    if (writer->checkpointFd >= 0)
+        close(writer->checkpointFd);
+
+    for (int i = 0; i < WRITE_BUFFERS; i++)
+        free(writer->ring[i].data);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->notEmpty);
+    pthread_cond_destroy(&writer->notFull);
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
@@ -1,6 +1,9 @@
 // Link layer protocol implementation
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,10 +11,21 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
 
+#include "byte_ring.h"
 #include "link_layer.h"
+#include "link_layer_ext.h"
+
+// The simulation build (see sim/sim.c) replaces the serial port, alarm()
+// and the clock, and runs Tx and Rx as threads: each one needs its own state.
+#ifdef LL_SIM
+#include "sim.h"
+#else
+#define LL_LOCAL
+#endif
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
@@ -19,13 +33,32 @@
 
 #define BUF_SIZE 5
 
-int alarmEnabled = FALSE;
-int alarmCount = 0;
-int fd;
-int llreadDisc = 0;
-struct termios oldtio;
-LinkLayerRole role;
-unsigned char buf[BUF_SIZE];
+// Control field of the frames that carry data
+#define I_FRAME(n) ((n) ? 0x40 : 0x00)
+#define I_MORE 0x20       // More frames of the same packet follow
+#define ECHO_REQUEST 0x0D // Calibration probe, sent back as it came
+#define ECHO_REPLY 0x0F
+#define CARRIES_DATA(c) (((c) & ~(I_FRAME(1) | I_MORE)) == 0 || (c) == ECHO_REQUEST || (c) == ECHO_REPLY)
+
+// Connection, and reconnection after an outage
+#define SET 0x03
+#define UA 0x07
+#define RECONNECT_ATTEMPTS 10
+#define RECONNECT_FIRST_MS 1000 // Doubled after every SET left unanswered
+#define RECONNECT_MAX_MS 30000
+
+// Answers to data frames, by the sequence number they refer to
+#define RR(n) ((n) ? 0x85 : 0x05)  // Frame 1-n taken, ready for frame n
+#define RNR(n) ((n) ? 0x89 : 0x09) // Frame 1-n taken, no room for frame n yet
+#define REJ(n) ((n) ? 0x01 : 0x81) // Frame n came damaged
+
+LL_LOCAL int alarmEnabled = FALSE;
+LL_LOCAL int alarmCount = 0;
+LL_LOCAL int fd;
+LL_LOCAL int llreadDisc = 0;
+LL_LOCAL struct termios oldtio;
+LL_LOCAL LinkLayerRole role;
+LL_LOCAL unsigned char buf[BUF_SIZE];
 enum message_state {
     START,
     FLAG_RCV,
@@ -37,12 +70,117 @@ enum message_state {
     ESC,
     END
 };
-int retransmissions;
-unsigned int trans_frame = 0;
-unsigned int prev_frame = 1;
-double baud;
-struct timeval start;
-struct timeval end;
+LL_LOCAL int retransmissions;
+LL_LOCAL unsigned int trans_frame = 0;
+LL_LOCAL unsigned int recv_frame = 0;
+LL_LOCAL unsigned int prev_frame = 1;
+LL_LOCAL double baud;
+LL_LOCAL struct timeval start;
+LL_LOCAL struct timeval end;
+
+// Reception pipeline. On Rx, a reader thread moves the bytes of the port to
+// lineBytes, and a decoder thread frames, checks and answers them: new data
+// frames go to lineFrames for llread, answers to our own frames to
+// lineAnswers for llwrite. The file writer thread of the application layer is
+// the last stage. Every queue is bounded, and a full one holds up the stage
+// before it, down to the acknowledgements that pace the transmitter.
+// Tx, and the simulation build, whose virtual clock expects a single thread
+// of each peer on the line, run the stages in turn in the calling thread.
+#define LINE_BYTES_SIZE (64 * 1024)
+#define LINE_FRAMES_SIZE (64 * 1024)
+#define LINE_ANSWERS_SIZE 64
+#define LINE_RELEASE_SIZE 4096 // Bytes decoded before their space goes back to the reader
+#define PIPELINE_POLL_MS 100
+
+#define FRAME_NONE -1
+#define FRAME_DISC -2
+
+LL_LOCAL ByteRing lineBytes;
+LL_LOCAL ByteRing lineFrames;
+LL_LOCAL ByteRing lineAnswers;
+LL_LOCAL const unsigned char *lineSpan;
+LL_LOCAL size_t lineLeft;
+LL_LOCAL size_t lineTaken;
+LL_LOCAL int pipelined = FALSE;
+LL_LOCAL atomic_int readerStop;
+LL_LOCAL atomic_int decoderStop;
+LL_LOCAL pthread_t readerThread;
+LL_LOCAL pthread_t decoderThread;
+LL_LOCAL pthread_mutex_t writeLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Flow control. Rx answers RNR instead of RR while lineFrames has no room
+// for one more frame, and llread sends the RR once it makes some.
+#define FRAME_RECORD_SIZE (sizeof(int) + MAX_PAYLOAD_SIZE)
+LL_LOCAL atomic_int readyAnswer; // RR owed to the peer, or 0
+
+// Transmission. Frames are encoded into a pool of buffers allocated at
+// llopen, and kept there until the peer acknowledges them. llwrite returns
+// once its frame is on the line: the application prepares the next packet,
+// and llwrite encodes it, while the frame before waits for its answer.
+// Worst case frame: header, every data byte and BCC2 stuffed, and flag,
+// rounded up to whole cache lines.
+#define MAX_FRAME_SIZE (4 + 2 * (MAX_PAYLOAD_SIZE + 1) + 1)
+#define FRAME_SLOT_SIZE ((MAX_FRAME_SIZE + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+#define FRAME_POOL_SIZE 2 // The frame on the line and the next one
+
+typedef struct
+{
+   unsigned char *data;
+   size_t size;
+} EncodedFrame;
+
+LL_LOCAL unsigned char *framePool;
+LL_LOCAL EncodedFrame frames[FRAME_POOL_SIZE];
+LL_LOCAL int nextFrame;
+LL_LOCAL EncodedFrame *sentFrame; // On the line and not acknowledged yet, or NULL
+LL_LOCAL int frameHeld;          // sentFrame waits for the peer to have room for it
+LL_LOCAL int peerBusy;           // The peer took the last frame, but has no room for the next
+
+// Pacing. While the peer keeps running out of room, what it took between two
+// RNR is what it can take, and frames go no faster, from a token bucket. The
+// rate goes up again while no RNR comes, and pacing stops once the bucket
+// no longer holds any frame back.
+#define PACE_BURST (2 * MAX_FRAME_SIZE)
+#define PACE_PROBE_FRAMES 32   // Frames taken without RNR before going faster
+#define PACE_MIN_INTERVAL 0.05 // Seconds between two RNR to measure the peer
+
+LL_LOCAL double paceRate; // Bytes per second, 0 when not pacing
+LL_LOCAL double paceTokens;
+LL_LOCAL struct timeval paceTime;  // Of the last refill
+LL_LOCAL struct timeval busyTime;  // Of the last RNR, zero if none lately
+LL_LOCAL double busyBytes;         // Taken by the peer since then
+LL_LOCAL int paceFrames;           // Taken since the last RNR or speed up
+LL_LOCAL int paceWaited;           // The bucket held a frame back since then
+
+// Frame being decoded, kept between calls
+LL_LOCAL enum message_state frameState = START;
+LL_LOCAL unsigned char frameControl;
+LL_LOCAL int frameSize;
+LL_LOCAL unsigned char frameData[MAX_PAYLOAD_SIZE + 1]; // Data and BCC2
+
+// Packet being assembled from frames with I_MORE
+LL_LOCAL unsigned char packetData[MAX_PAYLOAD_SIZE];
+LL_LOCAL int packetSize;
+
+// Calibration. Tx sends ECHO_REQUEST frames of a few sizes, which Rx sends
+// back: their round trip times give the rate and the latency of the line,
+// and the bits that changed on the way its error rate. Packets are then
+// split in frames of the size that moves the most data through a
+// stop-and-wait link with those figures, and the timeout becomes a margin
+// over the round trip of the largest of them.
+#define CALIBRATION_ROUNDS 3
+#define CALIBRATION_SIZES 2
+#define ECHO_TAG_SIZE 4          // Sequence number of the probe, in front of its data
+#define CALIBRATION_MIN_ERRORS 4 // Fewer bit errors do not bound the error rate
+#define FRAME_OVERHEAD 6         // Flags, header and BCC2
+#define TIMEOUT_MS 3000          // Until calibrated, and at most
+#define TIMEOUT_MARGIN_MS 50
+#define MIN_FRAME_LIMIT 64
+
+LL_LOCAL int frameLimit = MAX_PAYLOAD_SIZE; // Data bytes per frame
+LL_LOCAL int timeoutMs = TIMEOUT_MS;
+LL_LOCAL unsigned char echoData[MAX_PAYLOAD_SIZE + 1]; // Last ECHO_REPLY
+LL_LOCAL int echoSize;
 
 // Alarm function handler
 void alarmHandler(int signal){
@@ -50,6 +188,20 @@ void alarmHandler(int signal){
    alarmEnabled = FALSE;
 }
 
+/*Arms the timeout of the frame on the line, of ms milliseconds*/
+void startTimer(int ms) {
+   struct itimerval timer = {{0, 0}, {ms / 1000, ms % 1000 * 1000}};
+   setitimer(ITIMER_REAL, &timer, NULL);
+   alarmEnabled = TRUE;
+}
+
+/*Returns the seconds gone by since time*/
+double secondsSince(const struct timeval *time) {
+   struct timeval now;
+   gettimeofday(&now, NULL);
+   return (now.tv_sec - time->tv_sec) + (now.tv_usec - time->tv_usec) * 0.000001;
+}
+
 void establishSerialPort(LinkLayer connectionParameters) {
     // Program usage: Uses either COM1 or COM2
     const char *serialPortName = connectionParameters.serialPort;
@@ -113,6 +265,14 @@ void establishSerialPort(LinkLayer connectionParameters) {
     }
 
     printf("New termios structure set\n");
+
+    // Set alarm function handler. Blocking reads must return when it fires,
+    // for Rx to time out when it sends frames of its own.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = alarmHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, NULL);
 }
 
 void resetPortSettings() {
@@ -126,10 +286,392 @@ void resetPortSettings() {
     close(fd);
 }
 
-int llSetFrame() {
-   // Set alarm function handler
-   (void)signal(SIGALRM, alarmHandler);
+////////////////////////////////////////////////
+// LINE
+////////////////////////////////////////////////
+/*Writes to the port: on Rx, both the application and the decoder do*/
+void writeLine(const unsigned char *data, size_t size) {
+   pthread_mutex_lock(&writeLock);
+   write(fd, data, size);
+   pthread_mutex_unlock(&writeLock);
+}
+
+/*Sends the supervision frame with control field c*/
+void sendSupervision(unsigned char c) {
+   unsigned char supervision[BUF_SIZE] = {0x7E, 0x03, c, 0x03^c, 0x7E};
+   writeLine(supervision, BUF_SIZE);
+}
+
+/*Moves what the port has to lineBytes, returns what read() does*/
+int fillLine() {
+   unsigned char *span;
+   size_t room = ringSpace(&lineBytes, &span);
+   int bytes = read(fd, span, room);
+   if (bytes > 0)
+      ringCommit(&lineBytes, bytes);
+   return bytes;
+}
+
+/*Takes the next byte of the line, returns FALSE if none came in time*/
+int readLine(unsigned char *byte) {
+   if (lineLeft == 0) {
+      if (lineTaken > 0) {
+         ringRelease(&lineBytes, lineTaken);
+         lineTaken = 0;
+      }
+      if (pipelined ? !ringWaitData(&lineBytes, 1, PIPELINE_POLL_MS) : ringUsed(&lineBytes) == 0 && fillLine() <= 0)
+         return FALSE;
+      lineLeft = ringData(&lineBytes, &lineSpan);
+   }
+   *byte = *lineSpan++;
+   lineLeft--;
+   if (++lineTaken == LINE_RELEASE_SIZE) {
+      ringRelease(&lineBytes, lineTaken);
+      lineTaken = 0;
+   }
+   return TRUE;
+}
+
+/*Answers the peer that frames up to the one before "next" are taken, and
+  whether there is room for "next". Without room, llread owes it the RR*/
+void sendReady(unsigned int next) {
+   if (ringWaitSpace(&lineFrames, FRAME_RECORD_SIZE, 0)) {
+      atomic_store(&readyAnswer, 0);
+      sendSupervision(RR(next));
+      return;
+   }
+   sendSupervision(RNR(next));
+   atomic_store(&readyAnswer, RR(next));
+   // llread may have made room before it could see the RR owed
+   int ready;
+   if (ringWaitSpace(&lineFrames, FRAME_RECORD_SIZE, 0) && (ready = atomic_exchange(&readyAnswer, 0)) != 0)
+      sendSupervision(ready);
+}
+
+/*Adds a byte to the data frame being decoded. One longer than any frame
+  lost its end flag: it is rejected and dropped*/
+void storeFrameByte(unsigned char byte) {
+   if (frameSize == sizeof(frameData)) {
+      if (frameControl != ECHO_REQUEST && frameControl != ECHO_REPLY)
+         sendSupervision(REJ(recv_frame));
+      frameState = START;
+      return;
+   }
+   frameData[frameSize++] = byte;
+}
+
+/*Checks the BCC2 of the data frame just decoded and answers it, unless it is
+  new: returns its size then, for queueFrame to acknowledge it*/
+int checkFrame(unsigned char *packet) {
+   int size = frameSize - 1;
+   unsigned char bcc = 0;
+   for (int i = 0 ; i < size ; i++) {
+      bcc ^= frameData[i];
+   }
+   if (size < 0 || bcc != frameData[size]) {
+      sendSupervision(REJ(recv_frame));
+      return FRAME_NONE;
+   }
+   if (prev_frame == recv_frame) {
+      sendReady(1 - recv_frame);
+      return FRAME_NONE;
+   }
+   memcpy(packet, frameData, size);
+   return size;
+}
+
+/*Writes byte at packet_loc of the frame, stuffed if needed, and returns the next location*/
+unsigned int stuffing(unsigned char* frame, unsigned int packet_loc, unsigned char byte) {
+   if (byte == 0x7E || byte == 0x7D) {
+      frame[packet_loc++] = 0x7D;
+      frame[packet_loc++] = byte^0x20;
+   }
+   else {
+      frame[packet_loc++] = byte;
+   }
+   return packet_loc;
+}
+
+/*Handles the ECHO_REQUEST frame just decoded: a probe goes back as it came, damaged
+  or not, and a reply is kept for llcalibrate*/
+int echoFrame() {
+   if (frameControl == ECHO_REPLY) {
+      memcpy(echoData, frameData, frameSize);
+      echoSize = frameSize;
+      if (ringWaitSpace(&lineAnswers, 1, 0))
+         ringPut(&lineAnswers, &frameControl, 1);
+      return FRAME_NONE;
+   }
+   unsigned char reply[MAX_FRAME_SIZE];
+   unsigned int reply_loc = 4;
+   reply[0] = 0x7E;
+   reply[1] = 0x03;
+   reply[2] = ECHO_REPLY;
+   reply[3] = reply[1]^reply[2];
+   for (int i = 0 ; i < frameSize ; i++) {
+      reply_loc = stuffing(reply, reply_loc, frameData[i]);
+   }
+   reply[reply_loc++] = 0x7E;
+   writeLine(reply, reply_loc);
+   return FRAME_NONE;
+}
+
+/*Decodes the line up to the end of the next frame. Returns the size of a new
+  data frame, FRAME_DISC, or FRAME_NONE for anything else or if the line is
+  quiet. Answers to our own frames go to lineAnswers*/
+int decodeFrame(unsigned char *packet) {
+   unsigned char byte;
+   while (!atomic_load(&decoderStop) && readLine(&byte)) {
+      switch(frameState) {
+         case START:
+            if (byte == 0x7E)
+               frameState = FLAG_RCV;
+            break;
+         case FLAG_RCV:
+            if (byte == 0x03)
+               frameState = A_RCV;
+            else if (byte != 0x7E)
+               frameState = START;
+            break;
+         case A_RCV:
+            if (byte == ECHO_REQUEST || byte == ECHO_REPLY) {
+               frameControl = byte;
+               frameState = C_RCV;
+            }
+            else if (CARRIES_DATA(byte)) {   //I0, I1, with I_MORE or not
+               recv_frame = (byte & I_FRAME(1)) != 0;
+               frameControl = byte;
+               frameState = C_RCV;
+            }
+            else if (byte == RR(0) || byte == RR(1) || byte == RNR(0) || byte == RNR(1) || byte == REJ(0) || byte == REJ(1)
+                     || byte == SET || byte == UA) {
+               frameControl = byte;
+               frameState = C_RCV;
+            }
+            else if (byte == 0x0B) {
+               frameState = START;
+               llreadDisc = 1;
+               return FRAME_DISC;
+            }
+            else if (byte == 0x7E)
+               frameState = FLAG_RCV;
+            else
+               frameState = START;
+            break;
+         case C_RCV:
+            if (byte == (0x03^frameControl)) {
+               frameState = BCC_OK;
+               frameSize = 0;
+            }
+            else if (byte == 0x7E)
+               frameState = FLAG_RCV;
+            else
+               frameState = START;
+            break;
+         case BCC_OK:
+            if (!CARRIES_DATA(frameControl)) {
+               // Answers are dropped if llwrite is not waiting for them
+               frameState = START;
+               if (byte == 0x7E && frameControl == SET) {
+                  // The peer lost the line for a while: the session goes on
+                  sendSupervision(UA);
+                  return FRAME_NONE;
+               }
+               if (byte == 0x7E) {
+                  if (ringWaitSpace(&lineAnswers, 1, 0))
+                     ringPut(&lineAnswers, &frameControl, 1);
+                  return FRAME_NONE;
+               }
+            }
+            else if (byte == 0x7D)
+               frameState = ESC;
+            else if (byte == 0x7E) {
+               frameState = START;
+               if (frameControl == ECHO_REQUEST || frameControl == ECHO_REPLY)
+                  return echoFrame();
+               return checkFrame(packet);
+            }
+            else
+               storeFrameByte(byte);
+            break;
+         case ESC:
+            frameState = BCC_OK;
+            if (byte == 0x5E)
+               storeFrameByte(0x7E);
+            else if (byte == 0x5D)
+               storeFrameByte(0x7D);
+            break;
+         default:
+            break;
+      }
+   }
+   return FRAME_NONE;
+}
+
+/*Queues a new data frame, or the DISC that ends them, for llread, then
+  acknowledges it. Frames with I_MORE are held until the last one of their
+  packet. Returns -1 if llread had no room for it: the peer gets RNR, and
+  sends it again once llread makes room*/
+int queueFrame(const unsigned char *packet, int size) {
+   if (size >= 0 && (frameControl & I_MORE)) {
+      if (packetSize + size > MAX_PAYLOAD_SIZE)
+         packetSize = 0;   // Longer than any packet: the peer lost track
+      memcpy(packetData + packetSize, packet, size);
+      packetSize += size;
+      prev_frame = recv_frame;
+      sendReady(1 - recv_frame);
+      return 0;
+   }
+   int assembled = 0;
+   if (size >= 0) {
+      if (packetSize + size > MAX_PAYLOAD_SIZE)
+         packetSize = 0;
+      assembled = packetSize;
+   }
+   int length = size > 0 ? size : 0;
+   int total = size >= 0 ? assembled + size : size;
+   if (size >= 0 && !ringWaitSpace(&lineFrames, sizeof(total) + assembled + length, 0)) {
+      sendReady(recv_frame);
+      return -1;
+   }
+   while (!ringWaitSpace(&lineFrames, sizeof(total) + assembled + length, pipelined ? PIPELINE_POLL_MS : 0)) {
+      if (!pipelined || atomic_load(&decoderStop))
+         return -1;
+   }
+   ringPut(&lineFrames, &total, sizeof(total));
+   ringPut(&lineFrames, packetData, assembled);
+   ringPut(&lineFrames, packet, length);
+   packetSize -= assembled;
+   if (size >= 0) {
+      prev_frame = recv_frame;
+      sendReady(1 - recv_frame);
+   }
+   return 0;
+}
+
+/*Returns the control field of the next answer of the peer to our frames,
+  or -1 if none came in time*/
+int readAnswer() {
+   unsigned char packet[MAX_PAYLOAD_SIZE];
+   unsigned char answer;
+   if (!pipelined && ringUsed(&lineAnswers) == 0) {
+      int size = decodeFrame(packet);
+      if (size != FRAME_NONE)
+         queueFrame(packet, size);
+   }
+   if (!ringWaitData(&lineAnswers, 1, pipelined ? PIPELINE_POLL_MS : 0))
+      return -1;
+   ringGet(&lineAnswers, &answer, 1);
+   return answer;
+}
+
+#ifndef LL_SIM
+/*Reader stage: moves the bytes of the port to lineBytes as they come*/
+void *readerStage(void *arg) {
+   struct pollfd port = {fd, POLLIN, 0};
+   while (!atomic_load(&readerStop)) {
+      if (!ringWaitSpace(&lineBytes, 1, PIPELINE_POLL_MS) || poll(&port, 1, PIPELINE_POLL_MS) <= 0)
+         continue;
+      if (fillLine() < 0 && errno != EINTR)
+         break;
+   }
+   return NULL;
+}
 
+/*Decoder stage: frames, checks and acknowledges what the reader gets*/
+void *decoderStage(void *arg) {
+   unsigned char packet[MAX_PAYLOAD_SIZE];
+   while (!atomic_load(&decoderStop)) {
+      int size = decodeFrame(packet);
+      if (size == FRAME_NONE)
+         continue;
+      queueFrame(packet, size);
+      if (size == FRAME_DISC)
+         break;
+   }
+   return NULL;
+}
+#endif
+
+/*Starts a thread of the pipeline, with SIGALRM left to the application,
+  whose reads it must interrupt*/
+int startStage(pthread_t *thread, void *(*stage)(void *)) {
+   int result = -1;
+#ifndef LL_SIM
+   sigset_t alarmSet;
+   sigset_t previous;
+   sigemptyset(&alarmSet);
+   sigaddset(&alarmSet, SIGALRM);
+   pthread_sigmask(SIG_BLOCK, &alarmSet, &previous);
+   result = pthread_create(thread, NULL, stage, NULL) == 0 ? 0 : -1;
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+#endif
+   return result;
+}
+
+/*Sets up the frame pool and the queues of the line, and the reader thread of Rx*/
+int startLine() {
+   framePool = aligned_alloc(CACHE_LINE_SIZE, FRAME_POOL_SIZE * FRAME_SLOT_SIZE);
+   if (framePool == NULL || startByteRing(&lineBytes, LINE_BYTES_SIZE) == -1
+       || startByteRing(&lineFrames, LINE_FRAMES_SIZE) == -1 || startByteRing(&lineAnswers, LINE_ANSWERS_SIZE) == -1)
+      return -1;
+   for (int i = 0 ; i < FRAME_POOL_SIZE ; i++) {
+      frames[i].data = framePool + i * FRAME_SLOT_SIZE;
+   }
+   nextFrame = 0;
+   sentFrame = NULL;
+   frameHeld = FALSE;
+   peerBusy = FALSE;
+   packetSize = 0;
+   frameLimit = MAX_PAYLOAD_SIZE;
+   timeoutMs = TIMEOUT_MS;
+   paceRate = 0;
+   timerclear(&busyTime);
+   atomic_store(&readyAnswer, 0);
+   atomic_store(&readerStop, FALSE);
+   atomic_store(&decoderStop, FALSE);
+#ifndef LL_SIM
+   pipelined = role == LlRx && startStage(&readerThread, readerStage) == 0;
+#endif
+   return 0;
+}
+
+/*Starts the decoder thread of Rx, once the connection is up*/
+void startDecoder() {
+#ifndef LL_SIM
+   if (pipelined && startStage(&decoderThread, decoderStage) == -1) {
+      atomic_store(&readerStop, TRUE);
+      pthread_join(readerThread, NULL);
+      pipelined = FALSE;
+   }
+#endif
+}
+
+/*Stops the decoder, so that the caller reads the line itself*/
+void stopDecoder() {
+   if (!pipelined)
+      return;
+   atomic_store(&decoderStop, TRUE);
+   pthread_join(decoderThread, NULL);
+   atomic_store(&decoderStop, FALSE);
+}
+
+/*Stops the reader and frees the queues and the frame pool*/
+void stopLine() {
+   if (pipelined) {
+      atomic_store(&readerStop, TRUE);
+      closeByteRing(&lineBytes);
+      pthread_join(readerThread, NULL);
+      pipelined = FALSE;
+   }
+   freeByteRing(&lineBytes);
+   freeByteRing(&lineFrames);
+   freeByteRing(&lineAnswers);
+   free(framePool);
+   framePool = NULL;
+}
+
+int llSetFrame() {
    buf[0] = 0x7E;
    buf[1] = 0x03;
    buf[2] = 0x03;
@@ -147,7 +689,22 @@ int llSetFrame() {
       int bytes = write(fd, buf, BUF_SIZE);
       state = START;
       while (state != END) {
-         int reception = read(fd, &byte, 1);     
+         if (alarmEnabled == FALSE){
+            if (alarmCount > retransmissions) {
+               alarm(0);
+               alarmCount = 0;
+               state = END;
+               alarmExceeded = TRUE;
+               return -1;
+            }
+            else {
+               bytes = write(fd, buf, BUF_SIZE);
+               alarm(3);
+               alarmEnabled = TRUE;
+            }
+         }
+         if (!readLine(&byte))
+            continue;
          switch(state) {
             case START:
                if (byte == 0x7E)
@@ -186,21 +743,6 @@ int llSetFrame() {
                   state = START;
                break;
             }
-         
-         if (alarmEnabled == FALSE && state != END){
-            if (alarmCount > retransmissions) {
-               alarm(0);
-               alarmCount = 0;
-               state = END;
-               alarmExceeded = TRUE;
-               return -1;
-            }
-            else {
-               bytes = write(fd, buf, BUF_SIZE);
-               alarm(3);
-               alarmEnabled = TRUE;
-            }
-         }
       }
    }
    alarm(0);
@@ -215,7 +757,8 @@ void llUaFrame() {
     unsigned char byte;
 
     while (state != END) {
-        int bytes = read(fd, &byte, 1);
+        if (!readLine(&byte))
+            continue;
         switch(state) {
             case START:
                if (byte == 0x7E){
@@ -269,11 +812,15 @@ int llopen(LinkLayer connectionParameters)
    establishSerialPort(connectionParameters);
    gettimeofday(&start, NULL);
    int connection;
+   if (startLine() == -1) {
+      return -1;
+   }
    if (role == LlTx) {
       connection = llSetFrame();
    }
    else {
       llUaFrame();
+      startDecoder();
    }
    return connection;
 }
@@ -281,156 +828,368 @@ int llopen(LinkLayer connectionParameters)
 ////////////////////////////////////////////////
 // LLWRITE
 ////////////////////////////////////////////////
-void stuffing(unsigned char* frame, unsigned int packet_location, unsigned char special, unsigned int *size) {
-   frame = realloc(frame, ++(*size));
-   frame[packet_location] = 0x7D;
-   frame[packet_location+1] = special^0x20;
+int llwrite(const unsigned char *buf, int bufSize)
+{
+   struct iovec iov = {(void *)buf, bufSize};
+   return llwritev(&iov, 1);
 }
 
-int llwrite(const unsigned char *buf, int bufSize)
-{  
-   unsigned int bufSizeParam = bufSize+6;
-   unsigned char* frame = (unsigned char*) malloc (bufSizeParam);
-   memset(frame, 0, bufSize+6);
-   *frame = 0x7E;
-   *(frame+1) = 0x03;
-   if (trans_frame == 0) {
-      *(frame+2) = 0x00;
+/*The peer had no room for a frame: measures how fast it takes them*/
+void peerFull() {
+   if (timerisset(&busyTime)) {
+      double elapsed = secondsSince(&busyTime);
+      if (elapsed < PACE_MIN_INTERVAL)
+         return;
+      if (busyBytes > 0) {
+         paceRate = busyBytes / elapsed;
+         paceWaited = FALSE;
+      }
    }
-   else if (trans_frame == 1) {
-      *(frame+2) = 0x40;
+   gettimeofday(&busyTime, NULL);
+   busyBytes = 0;
+   paceFrames = 0;
+}
+
+/*The peer took a frame: goes faster after a while without RNR*/
+void peerTook(size_t size) {
+   busyBytes += size;
+   if (++paceFrames < PACE_PROBE_FRAMES)
+      return;
+   paceFrames = 0;
+   if (paceRate == 0 || !paceWaited) {
+      paceRate = 0;
+      timerclear(&busyTime);
+   }
+   else {
+      paceRate += paceRate / 8;
    }
-   *(frame+3) = *(frame+1)^*(frame+2);
+   paceWaited = FALSE;
+}
 
-   unsigned char bcc_2;
-   bcc_2 = *buf;
-   for (unsigned int i = 1 ; i < bufSize ; i++) {
-      bcc_2 ^= *(buf+i);
+/*Waits until the token bucket lets size bytes go*/
+void paceFrame(size_t size) {
+   if (paceRate == 0)
+      return;
+   paceTokens += secondsSince(&paceTime) * paceRate;
+   if (paceTokens > PACE_BURST)
+      paceTokens = PACE_BURST;
+   if (paceTokens < size) {
+      double wait = (size - paceTokens) / paceRate;
+      struct timespec delay = {(time_t)wait, (long)((wait - (time_t)wait) * 1000000000)};
+      while (nanosleep(&delay, &delay) == -1 && errno == EINTR);
+      paceTokens = size;
+      paceWaited = TRUE;
    }
-   unsigned int packet_loc = 4;
+   paceTokens -= size;
+   gettimeofday(&paceTime, NULL);
+}
 
-   for (unsigned int i = 0 ; i < bufSize ; i++) {
-      if (*(buf+i) == 0x7E) {
-         stuffing(frame, packet_loc, 0x7E, &bufSizeParam);
-         packet_loc++;
+/*The peer stopped answering: sends SET, further and further apart, until
+  it answers UA. Returns 0 then, with the session as it was, or -1*/
+int reconnect() {
+   int backoffMs = RECONNECT_FIRST_MS;
+   fprintf(stderr, "Link lost, reconnecting\n");
+   for (int attempt = 0 ; attempt < RECONNECT_ATTEMPTS ; attempt++) {
+      sendSupervision(SET);
+      startTimer(backoffMs);
+      int answer = -1;
+      while (answer != UA && alarmEnabled) {
+         answer = readAnswer();
       }
-      else if (*(buf+i) == 0x7D) {
-         stuffing(frame, packet_loc, 0x7D, &bufSizeParam);
-         packet_loc++;
+      alarm(0);
+      alarmEnabled = FALSE;
+      if (answer == UA) {
+         fprintf(stderr, "Link back\n");
+         return 0;
       }
-      else {
-         *(frame+packet_loc) = *(buf+i);
-      }
-      packet_loc++;
+      backoffMs = 2 * backoffMs < RECONNECT_MAX_MS ? 2 * backoffMs : RECONNECT_MAX_MS;
    }
+   return -1;
+}
 
-   if (bcc_2 == 0x7E) {
-      stuffing(frame, packet_loc, 0x7E, &bufSizeParam);
-      packet_loc+=2;
+/*Waits for the answer to the frame on the line, sending it again on REJ
+  and timeouts. A frame held back, or taken back on RNR, goes once the peer
+  has room for it. After an outage, the link is connected again and the frame
+  goes on. Returns 0 once it is acknowledged, or if there is none*/
+int awaitFrame() {
+   if (sentFrame == NULL) {
+      return 0;
    }
-   else if (bcc_2 == 0x7D) {
-      stuffing(frame, packet_loc, 0x7D, &bufSizeParam);
-      packet_loc+=2;
-   }
-   else {
-      *(frame+packet_loc) = bcc_2;
-      packet_loc++;
-   }
-   *(frame+packet_loc) = 0x7E;
-   packet_loc++;
-   
-   alarm(3);
-   alarmEnabled = TRUE;
-   unsigned char byte;
-   unsigned char cbyte;
+   unsigned int sequence = trans_frame;
    int accepted = FALSE;
    int alarmExceeded = FALSE; 
-   enum message_state state = START;
    while (!accepted && !alarmExceeded){
-      write(fd, frame, packet_loc);
-      state = START;
-      while (state != END) { 
-         read(fd, &byte, 1);
-         switch (state) {
-            case START:
-                  if (byte == 0x7E) {
-                     state = FLAG_RCV;
-                  }    
-                  break;
-            case FLAG_RCV:
-                  if (byte == 0x03) {
-                     state = A_RCV;
-                  }
-                  else if (byte == 0x7E) {
-                     state = FLAG_RCV;
-                  }  
-                  else {
-                     state = START;
-                  }  
-                  break;
-            case A_RCV:
-                  if (byte == 0x05 || byte == 0x85){  // RR0, RR1 
-                     accepted = TRUE;
-                     state = C_RCV;
-                     cbyte = byte;
-                  }
-                  else if(byte == 0x01 || byte == 0x81) {   //REJ0, REJ1
-                     state = C_RCV;
-                     cbyte = byte;
-                  }
-                  else if (byte == 0x7E) {
-                     state = FLAG_RCV;
-                  }
-                  else {
-                     state = START;
-                  }
-                  break;
-            case C_RCV:
-                  if (byte == (0x03^cbyte)) {
-                     state = BCC_OK;
-                  }
-                  else if (byte == 0x7E) {
-                     state = FLAG_RCV;
-                  }
-                  else {
-                     state = START;
-                  }
-                  break;
-            case BCC_OK:
-                  if (byte == 0x7E){
-                     state = END;
-                  }
-                  else {
-                     state = START;
-                  }
-                  break;
-            default: 
-                  break;
-         }
-         if (alarmEnabled == FALSE && state != END){
+      int answer = -1;
+      while (answer == -1 && !alarmExceeded) { 
+         if (alarmEnabled == FALSE){
             if (alarmCount > retransmissions) {
                alarm(0);
-               alarmExceeded = TRUE;
-               state = END;
+               alarmCount = 0;
+               alarmExceeded = reconnect() == -1;
             }
-            else{
-               int bytes = write(fd, frame, packet_loc);
-               alarm(3);
-               alarmEnabled = TRUE;
+            if (!alarmExceeded && alarmEnabled == FALSE) {
+               // A held frame goes after a timeout too, to ask the peer again
+               writeLine(sentFrame->data, sentFrame->size);
+               frameHeld = FALSE;
+               startTimer(timeoutMs);
             }
          }
+         answer = readAnswer();
+      }
+      if (answer == RR(1 - sequence) || answer == RNR(1 - sequence)) {
+         accepted = TRUE;
+         peerBusy = answer == RNR(1 - sequence);
+         if (peerBusy)
+            peerFull();
+         peerTook(sentFrame->size);
       }
+      else if (answer == RNR(sequence)) {
+         // The peer is there, only out of room: no retransmission is lost
+         frameHeld = TRUE;
+         peerFull();
+         alarmCount = 0;
+         startTimer(timeoutMs);
+      }
+      else if (answer == REJ(sequence) || (answer == RR(sequence) && frameHeld)) {
+         writeLine(sentFrame->data, sentFrame->size);
+         frameHeld = FALSE;
+      }
+      // Anything else answers an earlier frame
    }
    alarm(0);
    alarmCount = 0;
    alarmEnabled = FALSE;
-   if (accepted) {
-      trans_frame = 1 - trans_frame;
-      return packet_loc;
+   sentFrame = NULL;
+   frameHeld = FALSE;
+   if (!accepted) {
+      return -1;
+   }
+   trans_frame = 1 - trans_frame;
+   return 0;
+}
+
+/*Puts the encoded frame on the line, once the frame before is acknowledged*/
+int sendFrame(EncodedFrame *encoded) {
+   if (awaitFrame() == -1) {
+      return -1;
+   }
+
+   // Answers to an earlier frame, that came too late, are not for this one,
+   // unless the peer owes the RR for it
+   while (!peerBusy && ringUsed(&lineAnswers) > 0) {
+      unsigned char stale;
+      ringGet(&lineAnswers, &stale, 1);
+   }
+
+   // Without room at the peer, the frame waits for its RR, or a timeout
+   if (peerBusy) {
+      frameHeld = TRUE;
+      peerBusy = FALSE;
    }
    else {
+      paceFrame(encoded->size);
+      writeLine(encoded->data, encoded->size);
+   }
+   sentFrame = encoded;
+   startTimer(timeoutMs);
+   return 0;
+}
+
+int llwritev(const struct iovec *iov, int iovcnt)
+{  
+   size_t bufSize = 0;
+   for (int v = 0 ; v < iovcnt ; v++) {
+      bufSize += iov[v].iov_len;
+   }
+   if (bufSize > MAX_PAYLOAD_SIZE) {
       return -1;
    }
+
+   // Packets longer than the calibrated frames go in several, with I_MORE
+   // on all of them but the last
+   int v = 0;
+   size_t i = 0;
+   size_t left = bufSize;
+   int written = 0;
+   do {
+      size_t size = left < (size_t)frameLimit ? left : (size_t)frameLimit;
+      left -= size;
+
+      // Encoded while the frame before is still on the line
+      EncodedFrame *encoded = &frames[nextFrame];
+      nextFrame = (nextFrame + 1) % FRAME_POOL_SIZE;
+      unsigned char *frame = encoded->data;
+      unsigned int sequence = sentFrame != NULL ? 1 - trans_frame : trans_frame;
+      frame[0] = 0x7E;
+      frame[1] = 0x03;
+      frame[2] = I_FRAME(sequence) | (left > 0 ? I_MORE : 0);
+      frame[3] = frame[1]^frame[2];
+
+      // BCC2 and stuffing in a single pass over the data
+      unsigned char bcc_2 = 0;
+      unsigned int packet_loc = 4;
+      for ( ; size > 0 ; size--) {
+         while (i == iov[v].iov_len) {
+            v++;
+            i = 0;
+         }
+         unsigned char byte = ((const unsigned char *)iov[v].iov_base)[i++];
+         bcc_2 ^= byte;
+         packet_loc = stuffing(frame, packet_loc, byte);
+      }
+      packet_loc = stuffing(frame, packet_loc, bcc_2);
+      frame[packet_loc] = 0x7E;
+      packet_loc++;
+      encoded->size = packet_loc;
+
+      if (sendFrame(encoded) == -1) {
+         return -1;
+      }
+      written += packet_loc;
+   } while (left > 0);
+   return written;
+}
+
+////////////////////////////////////////////////
+// LLCALIBRATE
+////////////////////////////////////////////////
+/*Sends an ECHO_REQUEST with size bytes of data, and waits for it to come
+  back. Returns the round trip in seconds, or -1 if it did not come back in
+  time. Counts the bits the line changed, and the bytes of the frame*/
+double echoProbe(int size, unsigned int sequence, int *frameBytes, long *bitErrors, long *bits) {
+   unsigned char probe[MAX_PAYLOAD_SIZE + 1];
+   unsigned char *frame = frames[nextFrame].data;
+   frame[0] = 0x7E;
+   frame[1] = 0x03;
+   frame[2] = ECHO_REQUEST;
+   frame[3] = frame[1]^frame[2];
+   unsigned char bcc_2 = 0;
+   unsigned int packet_loc = 4;
+   unsigned int seed = sequence;
+   for (int i = 0 ; i < size ; i++) {
+      seed = seed * 1103515245 + 12345;
+      // The sequence number comes first: it tells late replies apart
+      probe[i] = i < ECHO_TAG_SIZE ? sequence >> (8 * (ECHO_TAG_SIZE - 1 - i)) : seed >> 16;
+      bcc_2 ^= probe[i];
+      packet_loc = stuffing(frame, packet_loc, probe[i]);
+   }
+   probe[size] = bcc_2;
+   packet_loc = stuffing(frame, packet_loc, bcc_2);
+   frame[packet_loc++] = 0x7E;
+   *frameBytes = packet_loc;
+
+   struct timeval sent;
+   gettimeofday(&sent, NULL);
+   writeLine(frame, packet_loc);
+   startTimer(timeoutMs);
+   int answer = -1;
+   while (alarmEnabled) {
+      answer = readAnswer();
+      if (answer == ECHO_REPLY && echoSize >= ECHO_TAG_SIZE && memcmp(echoData, probe, ECHO_TAG_SIZE) == 0)
+         break;
+      answer = -1;
+   }
+   double roundTrip = secondsSince(&sent);
+   alarm(0);
+   alarmCount = 0;
+   alarmEnabled = FALSE;
+
+   // Both ways over the line: a frame that lost bytes counts as one error
+   *bits += 2 * 8 * (size + 1);
+   if (answer != ECHO_REPLY) {
+      (*bitErrors)++;
+      return -1;
+   }
+   if (echoSize != size + 1) {
+      (*bitErrors)++;
+      return roundTrip;
+   }
+   for (int i = 0 ; i <= size ; i++) {
+      *bitErrors += __builtin_popcount(echoData[i] ^ probe[i]);
+   }
+   return roundTrip;
+}
+
+/*Returns base to the power of n*/
+double power(double base, int n) {
+   double result = 1;
+   for ( ; n > 0 ; n >>= 1) {
+      if (n & 1)
+         result *= base;
+      base *= base;
+   }
+   return result;
+}
+
+int llcalibrate() {
+   static const int sizes[CALIBRATION_SIZES] = {16, MAX_PAYLOAD_SIZE / 4};
+   double roundTrip[CALIBRATION_SIZES] = {0};
+   int echoes[CALIBRATION_SIZES] = {0};
+   int frameBytes[CALIBRATION_SIZES];
+   long bitErrors = 0;
+   long bits = 0;
+   int last = CALIBRATION_SIZES - 1;
+
+   if (role != LlTx || awaitFrame() == -1) {
+      return -1;
+   }
+   for (int round = 0 ; round < CALIBRATION_ROUNDS ; round++) {
+      for (int k = 0 ; k < CALIBRATION_SIZES ; k++) {
+         double time = echoProbe(sizes[k], round * CALIBRATION_SIZES + k + 1, &frameBytes[k], &bitErrors, &bits);
+         if (time >= 0) {
+            roundTrip[k] += time;
+            echoes[k]++;
+         }
+      }
+   }
+   if (echoes[0] == 0 || echoes[last] == 0) {
+      return -1;
+   }
+
+   // A round trip is the frame both ways at the line rate, plus the latency
+   double small = roundTrip[0] / echoes[0];
+   double large = roundTrip[last] / echoes[last];
+   if (large <= small) {
+      return -1;
+   }
+   double rate = 2.0 * (frameBytes[last] - frameBytes[0]) / (large - small);
+   double latency = small - 2.0 * frameBytes[0] / rate;
+   if (latency < 0) {
+      latency = 0;
+   }
+   double ber = (double)bitErrors / bits;
+
+   // The probes only carry some thousand bits: a few errors among them tell
+   // little, and the frames stay as large as they can be
+   double sizingBer = bitErrors >= CALIBRATION_MIN_ERRORS ? ber : 0;
+
+   // Data of a frame over the time of it and its answer, times the odds
+   // that both get through
+   double best = 0;
+   for (int size = MIN_FRAME_LIMIT ; ; size += MIN_FRAME_LIMIT) {
+      if (size > MAX_PAYLOAD_SIZE) {
+         size = MAX_PAYLOAD_SIZE;
+      }
+      int lineBytes = size + FRAME_OVERHEAD + BUF_SIZE;
+      double goodput = size * power(1 - sizingBer, 8 * lineBytes) / (lineBytes / rate + latency);
+      if (goodput > best) {
+         best = goodput;
+         frameLimit = size;
+      }
+      if (size == MAX_PAYLOAD_SIZE) {
+         break;
+      }
+   }
+
+   // Every byte of the largest frame stuffed, both ways
+   double worst = 2 * (2 * frameLimit + FRAME_OVERHEAD) / rate + latency;
+   timeoutMs = (int)(2 * worst * 1000) + TIMEOUT_MARGIN_MS;
+   if (timeoutMs > TIMEOUT_MS) {
+      timeoutMs = TIMEOUT_MS;
+   }
+   printf("Line: %.0f bytes/s, %.1f ms latency, %.1e bit error rate. Frames of %d bytes, %d ms timeout\n",
+          rate, latency * 1000, ber, frameLimit, timeoutMs);
+   return 0;
 }
 
 ////////////////////////////////////////////////
@@ -438,115 +1197,32 @@ int llwrite(const unsigned char *buf, int bufSize)
 ////////////////////////////////////////////////
 int llread(unsigned char *packet)
 {  
-   unsigned char tmp[2050];
-   enum message_state state = START;
-   unsigned char byte;
-   int bcc = 0;
-   int size = 0;
-   while (state != END) {
-      int bytes = read(fd, &byte, 1);
-      switch(state) {
-         case START:
-            if (byte == 0x7E){
-               state = FLAG_RCV;
-               }
-            break;
-         case FLAG_RCV:
-            if (byte == 0x03){
-               state = A_RCV;
-               }
-            else if (byte != 0x7E)
-               state = START;
-            break;
-         case A_RCV:
-            if (byte == 0x00){
-               trans_frame = 0;
-               state = C_RCV;
-            }
-            else if (byte == 0x40){
-               trans_frame = 1;
-               state = C_RCV;
-            }
-            else if (byte == 0x0B) {
-               llreadDisc = 1;
-               return -2;
-            }
-            else if (byte == 0x7E)
-               state = FLAG_RCV;
-            else
-               state = START;
-            break;
-         case C_RCV:
-            if (byte == 0x03^0x00 || byte == 0x03^0x40){
-               state = BCC_OK;
-               }
-            else if (byte == 0x7E)
-               state = FLAG_RCV;
-            else
-               state = START;
-            break;
-         case BCC_OK:
-            if (byte == 0x7D)
-               state = ESC;
-            else if (byte == 0x7E){
-               int bcc;
-               size-=1;
-               bcc = tmp[0];
-               for (unsigned int i = 1 ; i < size; i++) {
-                  bcc ^= tmp[i];
-               }
-               if (bcc == tmp[size]){
-                  memcpy(packet,tmp,MAX_PAYLOAD_SIZE);
-                  state = END;
-                  buf[0]=0x7E;
-                  buf[1]=0x03;
-                  if (trans_frame)
-                     buf[2]=0x05;
-                  else
-                     buf[2]=0x85;
-                  buf[3]=buf[1]^buf[2];
-                  buf[4]=0x7E;
-                  write(fd,buf,BUF_SIZE);
-                  if (prev_frame != trans_frame){
-                    prev_frame = trans_frame;
-                    return size;
-                  }
-                  return -1;
-                  write(fd,buf,BUF_SIZE); 
-                  return size;
-               }
-               else{
-                  buf[0]=0x7E;
-                  buf[1]=0x03;
-                  if (trans_frame)
-                     buf[2]=0x01;
-                  else
-                     buf[2]=0x81;
-                  buf[3]=buf[1]^buf[2];
-                  buf[4]=0x7E;
-                  write(fd,buf,BUF_SIZE);
-                  return -1;
-               }
+   int size;
+   // Our own last frame goes through first: the peer answers it
+   if (awaitFrame() == -1) {
+      return -2;
+   }
 
-            }
-            else {
-               tmp[size] = byte;
-               size++;
-            }
-            break;
-         case ESC:
-            state = BCC_OK;
-            if (byte == 0x5E){
-               tmp[size]=0x7E;
-               size++;
-            }
-            else if (byte == 0x5D){
-               tmp[size]=0x7D;
-               size++;
-            }
-            break;
+   // Without the decoder thread, the caller decodes until a frame is queued
+   while (!ringWaitData(&lineFrames, sizeof(size), pipelined ? PIPELINE_POLL_MS : 0)) {
+      if (!pipelined) {
+         size = decodeFrame(packet);
+         if (size != FRAME_NONE)
+            queueFrame(packet, size);
       }
    }
+   ringGet(&lineFrames, &size, sizeof(size));
+   if (size > 0) {
+      ringWaitData(&lineFrames, size, -1);
+      ringGet(&lineFrames, packet, size);
+   }
+
+   // The decoder answered RNR: the RR goes once there is room again
+   int ready = atomic_load(&readyAnswer);
+   if (ready != 0 && ringWaitSpace(&lineFrames, FRAME_RECORD_SIZE, 0) && (ready = atomic_exchange(&readyAnswer, 0)) != 0) {
+      sendSupervision(ready);
+   }
+   return size;
 }
 
 ////////////////////////////////////////////////
@@ -571,7 +1247,21 @@ int llcloseTx(){
       int bytes = write(fd, buf, BUF_SIZE);
       state = START;
       while (state != END){ 
-         int reception = read(fd, &byte, 1);     
+         if (alarmEnabled == FALSE){
+            if (alarmCount > retransmissions) {
+               alarm(0);
+               state = END;
+               alarmExceeded = TRUE;
+               return -1;
+            }
+            else{
+               int bytes = write(fd, buf, BUF_SIZE);
+               alarm(3);
+               alarmEnabled = TRUE;
+            }
+         }
+         if (!readLine(&byte))
+            continue;
          switch(state) {
             case START:
                if (byte == 0x7E)
@@ -608,20 +1298,6 @@ int llcloseTx(){
                   state = START;
                break;
          }   
-
-         if (alarmEnabled == FALSE && state != END){
-            if (alarmCount > retransmissions) {
-               alarm(0);
-               state = END;
-               alarmExceeded = TRUE;
-               return -1;
-            }
-            else{
-               int bytes = write(fd, buf, BUF_SIZE);
-               alarm(3);
-               alarmEnabled = TRUE;
-            }
-         }
       }
    }
    alarm(0);
@@ -645,7 +1321,8 @@ void llcloseRx(){
       state = C_RCV;
       }
    while (state != END) {
-      int bytes = read(fd, &byte, 1);
+      if (!readLine(&byte))
+         continue;
       switch(state) {
          case START:
             if (byte == 0x7E)
@@ -690,7 +1367,8 @@ void llcloseRx(){
    int bytes = write(fd, buf, BUF_SIZE);
    state = START;
    while (state != END) {
-      int bytes = read(fd, &byte, 1);
+      if (!readLine(&byte))
+         continue;
 
       switch(state) {
          case START:
@@ -738,16 +1416,22 @@ void printStatistics() {
     printf("CPU Time Used: %f seconds\n", cpu_time);
     printf("Transfer Rate: %f bits/s\n", transfer_rate);
     printf("Efficiency: %f %%\n", efficiency);
-    printf("Maximum Payload Size: %d\n", MAX_PAYLOAD_SIZE);
+    printf("Maximum Payload Size: %d\n", frameLimit);
 }
 
 int llclose(int showStatistics){
-   int connection;  
+   int connection = 0;
+   // The last frame is answered before the disconnection. If it never is,
+   // the peer is gone: the link is only torn down, and the close fails
+   int pending = awaitFrame();
     if (role == LlTx) {
-        connection = llcloseTx();
+        if (pending == 0)
+            connection = llcloseTx();
     }
     else {
-        llcloseRx();
+        stopDecoder();
+        if (pending == 0)
+            llcloseRx();
     }
 
     gettimeofday(&end, NULL);
@@ -755,7 +1439,11 @@ int llclose(int showStatistics){
         printStatistics();
     }
 
+    stopLine();
     resetPortSettings();
 
+    if (pending == -1) {
+        return -1;
+    }
     return connection;
 }
@@ -0,0 +1,140 @@
+// LZ block codec implementation.
+
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS 14
+
+static uint32_t read32(const unsigned char *p){
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+//Writes a length continued in bytes of 255, returns the next position or -1
+static int writeLength(unsigned char *dst, int out, int capacity, int length){
+    for (; length >= 255; length -= 255) {
+        if (out >= capacity)
+            return -1;
+        dst[out++] = 255;
+    }
+    if (out >= capacity)
+        return -1;
+    dst[out++] = length;
+    return out;
+}
+
+//Writes a sequence of literals and a match, a length 0 match ends the block
+static int writeSequence(unsigned char *dst, int out, int capacity, const unsigned char *literals, int literalLength, int offset, int matchLength){
+    int matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+
+    if (out >= capacity)
+        return -1;
+    dst[out++] = (literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+    if (literalLength >= 15 && (out = writeLength(dst, out, capacity, literalLength - 15)) == -1)
+        return -1;
+    if (literalLength > capacity - out)
+        return -1;
+    memcpy(dst + out, literals, literalLength);
+    out += literalLength;
+
+    if (matchLength == 0)
+        return out;
+    if (capacity - out < 2)
+        return -1;
+    dst[out++] = offset & 0xFF;
+    dst[out++] = offset >> 8;
+    if (matchCode >= 15 && (out = writeLength(dst, out, capacity, matchCode - 15)) == -1)
+        return -1;
+    return out;
+}
+
+int lzCompress(const unsigned char *src, int size, unsigned char *dst, int capacity){
+    uint32_t table[1 << HASH_BITS]; // Last position of each hash, plus one
+    int anchor = 0;
+    int pos = 0;
+    int out = 0;
+
+    memset(table, 0, sizeof(table));
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t sequence = read32(src + pos);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        int candidate = (int)table[hash] - 1;
+        table[hash] = pos + 1;
+
+        if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET || read32(src + candidate) != sequence) {
+            // Step faster over data that keeps not matching
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        int length = LZ_MIN_MATCH;
+        while (pos + length < size && src[candidate + length] == src[pos + length])
+            length++;
+        out = writeSequence(dst, out, capacity, src + anchor, pos - anchor, pos - candidate, length);
+        if (out == -1)
+            return 0;
+        pos += length;
+        anchor = pos;
+    }
+
+    out = writeSequence(dst, out, capacity, src + anchor, size - anchor, 0, 0);
+    return out == -1 ? 0 : out;
+}
+
+//Reads a length continued in bytes of 255, returns the next position or -1
+static int readLength(const unsigned char *src, int in, int size, int *length){
+    unsigned char byte;
+
+    do {
+        if (in >= size)
+            return -1;
+        byte = src[in++];
+        *length += byte;
+    } while (byte == 255);
+    return in;
+}
+
+int lzDecompress(const unsigned char *src, int size, unsigned char *dst, int capacity){
+    int in = 0;
+    int out = 0;
+
+    while (in < size) {
+        int token = src[in++];
+        int literalLength = token >> 4;
+        if (literalLength == 15 && (in = readLength(src, in, size, &literalLength)) == -1)
+            return -1;
+        if (literalLength > size - in || literalLength > capacity - out)
+            return -1;
+        memcpy(dst + out, src + in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        // The last sequence has no match
+        if (in == size)
+            break;
+        if (size - in < 2)
+            return -1;
+        int offset = src[in] | src[in + 1] << 8;
+        in += 2;
+        int matchLength = token & 15;
+        if (matchLength == 15 && (in = readLength(src, in, size, &matchLength)) == -1)
+            return -1;
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || matchLength > capacity - out)
+            return -1;
+
+        // Matches may overlap what they copy: runs repeat their start
+        if (offset >= matchLength) {
+            memcpy(dst + out, dst + out - offset, matchLength);
+        }
+        else {
+            for (int i = 0; i < matchLength; i++)
+                dst[out + i] = dst[out - offset + i];
+        }
+        out += matchLength;
+    }
+    return out;
+}
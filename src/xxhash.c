@@ -0,0 +1,133 @@
+// XXH64 hash implementation.
+// Follows the reference specification of XXH64 by Yann Collet: same
+// results on any host, whatever its byte order.
+
+#include "xxhash.h"
+
+#include <string.h>
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+//Reads little-endian words
+static uint64_t read64(const unsigned char *p){
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+         | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t read32(const unsigned char *p){
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input){
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t acc, uint64_t v){
+    acc ^= round64(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+void xxh64Reset(Xxh64State *state, uint64_t seed){
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + PRIME1 + PRIME2;
+    state->v[1] = seed + PRIME2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME1;
+}
+
+void xxh64Update(Xxh64State *state, const void *data, size_t size){
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+
+    state->total += size;
+
+    // Complete the stripe left over by the previous call
+    if (state->bufferSize > 0) {
+        size_t n = 32 - state->bufferSize;
+        if (n > size) {
+            memcpy(state->buffer + state->bufferSize, p, size);
+            state->bufferSize += size;
+            return;
+        }
+        memcpy(state->buffer + state->bufferSize, p, n);
+        for (int i = 0; i < 4; i++)
+            state->v[i] = round64(state->v[i], read64(state->buffer + 8 * i));
+        p += n;
+        state->bufferSize = 0;
+    }
+
+    // Whole 32-byte stripes, straight from the data
+    uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+    while (end - p >= 32) {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+        p += 32;
+    }
+    state->v[0] = v0;
+    state->v[1] = v1;
+    state->v[2] = v2;
+    state->v[3] = v3;
+
+    memcpy(state->buffer, p, end - p);
+    state->bufferSize = end - p;
+}
+
+uint64_t xxh64Digest(const Xxh64State *state){
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = mergeRound(h, state->v[i]);
+    }
+    else {
+        h = state->seed + PRIME5;
+    }
+    h += state->total;
+
+    const unsigned char *p = state->buffer;
+    const unsigned char *end = p + state->bufferSize;
+    while (end - p >= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed){
+    Xxh64State state;
+
+    xxh64Reset(&state, seed);
+    xxh64Update(&state, data, size);
+    return xxh64Digest(&state);
+}